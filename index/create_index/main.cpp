@@ -1,33 +1,46 @@
 #include <iostream>
 #include <stdexcept>
 
+#include <cmdline.h>
 #include <index.h>
+#include <sortcmdline.h>
 
 namespace {
 
 void printUsage() {
-    std::cout << "Usage: create_index data_file_name chunk_dir items_in_chunk thread_count out_file_name\n";
+    std::cout << "Usage: create_index data_file_name chunk_dir items_in_chunk thread_count out_file_name [metrics_file_name] [options]\n";
+    std::cout << "chunk_dir can list several directories separated by ':', chunks are striped over them\n";
+    std::cout << sortOptionsUsage();
 }
 
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
+    CommandLine commandLine(argc, argv);
+
+    if (commandLine.argCount() != 5 && commandLine.argCount() != 6) {
         printUsage();
         return 1;
     }
 
-    const char* dataFileName = argv[1];
-    const char* chunkDir = argv[2];
-    size_t itemsInChunk = atoi(argv[3]);
-    size_t threadCount = atoi(argv[4]);
-    const char* outputFileName = argv[5];
+    const char* dataFileName = commandLine.arg(0);
+    const char* chunkDir = commandLine.arg(1);
+    size_t itemsInChunk = atoi(commandLine.arg(2));
+    size_t threadCount = atoi(commandLine.arg(3));
+    const char* outputFileName = commandLine.arg(4);
 
     try {
+        SortMetrics metrics;
+        SortOptions options = parseSortOptions(commandLine, 5, &metrics);
+        // Index key is made of header only
+        options.headerOnlyScan = true;
+
         createIndex<DataEntry, IndexEntry>(dataFileName, chunkDir, outputFileName,
                 itemsInChunk, threadCount, [](const DataEntry& data, size_t filePos) {
             return IndexEntry(data.header.key, filePos);
-        });
+        }, options);
+
+        writeMetrics(commandLine, 5, metrics);
     } catch (std::exception& ex) {
         std::cerr << ex.what() << "\n";
         return 1;
@@ -1,51 +1,370 @@
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <random>
+#include <set>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmdline.h>
 #include <data.h>
 #include <exception.h>
-#include <filearchive.h>
+#include <memarchive.h>
+#include <noncopyable.h>
+#include <parallel.h>
 #include <serializer.h>
+#include <threadpool.h>
 
 namespace {
 
 void printUsage() {
-    std::cout << "Usage: create_test_data record_count out_file_name\n";
+    std::cout << "Usage: create_test_data record_count out_file_name [options]\n";
+    std::cout << "Options:\n"
+        "  --threads=count          generating threads, default is number of cores\n"
+        "  --seed=number            the same seed gives the same file for any thread count, default 1\n"
+        "  --keys=distribution      uniform, zipf, sorted, reverse, nearly-sorted or duplicates, default uniform\n"
+        "  --distinct-keys=count    keys zipf and duplicates choose from, default 1000000 and 100\n"
+        "  --zipf-skew=value        exponent of zipf distribution, default 1\n"
+        "  --disorder=fraction      records of nearly-sorted with random key, default 0.01\n"
+        "  --payload=distribution   payload size: fixed:N, uniform:MIN:MAX or exponential:MEAN, default uniform:0:99\n";
 }
 
-void getRandKey(Key& key) {
-    for (size_t i = 0; i < key.size(); ++i) {
-        key[i] = rand() % 255;
+// Records are generated by blocks. Every block has its own random generators seeded by
+// seed and block index, so file doesn't depend on thread count. Payload sizes of all
+// blocks are generated first to find file offsets of blocks, then blocks are generated
+// and written to their ranges of file concurrently.
+const size_t BLOCK_RECORDS = 1 << 16;
+
+uint64_t mix(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+enum KeyDistribution {
+    UniformKeys,
+    ZipfKeys,
+    SortedKeys,
+    ReverseKeys,
+    NearlySortedKeys,
+    DuplicateKeys
+};
+
+enum PayloadDistribution {
+    FixedPayload,
+    UniformPayload,
+    ExponentialPayload
+};
+
+struct Config {
+    Config() :
+            recordCount(0),
+            seed(1),
+            keys(UniformKeys),
+            distinctKeys(0),
+            zipfSkew(1),
+            disorder(0.01),
+            payload(UniformPayload),
+            payloadMin(0),
+            payloadMax(99),
+            payloadMean(0) {}
+
+    uint64_t recordCount;
+    uint64_t seed;
+    KeyDistribution keys;
+    uint64_t distinctKeys;
+    double zipfSkew;
+    double disorder;
+    PayloadDistribution payload;
+    uint64_t payloadMin;
+    uint64_t payloadMax;
+    double payloadMean;
+};
+
+KeyDistribution parseKeyDistribution(const std::string& name) {
+    if (name == "uniform") {
+        return UniformKeys;
+    } else if (name == "zipf") {
+        return ZipfKeys;
+    } else if (name == "sorted") {
+        return SortedKeys;
+    } else if (name == "reverse") {
+        return ReverseKeys;
+    } else if (name == "nearly-sorted") {
+        return NearlySortedKeys;
+    } else if (name == "duplicates") {
+        return DuplicateKeys;
     }
+
+    throw Exception() << "Unknown key distribution" << name;
+}
+
+void parsePayloadDistribution(const std::string& value, Config& config) {
+    std::vector<std::string> parts;
+
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = std::min(value.find(':', begin), value.size());
+        parts.push_back(value.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    try {
+        if (parts[0] == "fixed" && parts.size() == 2) {
+            config.payload = FixedPayload;
+            config.payloadMin = config.payloadMax = std::stoull(parts[1]);
+            return;
+        } else if (parts[0] == "uniform" && parts.size() == 3) {
+            config.payload = UniformPayload;
+            config.payloadMin = std::stoull(parts[1]);
+            config.payloadMax = std::stoull(parts[2]);
+            if (config.payloadMin <= config.payloadMax) {
+                return;
+            }
+        } else if (parts[0] == "exponential" && parts.size() == 2) {
+            config.payload = ExponentialPayload;
+            config.payloadMean = std::stod(parts[1]);
+            if (config.payloadMean > 0) {
+                return;
+            }
+        }
+    } catch (const std::logic_error&) {
+    }
+
+    throw Exception() << "Wrong payload distribution" << value;
 }
 
-void createTestData(const char* outFileName, size_t recordCount) {
-    FileOutArchive archive(outFileName);
-    for (size_t i = 0; i < recordCount; ++i) {
-        std::vector<char> data(rand() % 100);
+class RecordGenerator {
+public:
+    RecordGenerator(const Config& cfg, size_t block) :
+            config(cfg),
+            keyRandom(mix(cfg.seed ^ mix(block * 2))),
+            payloadRandom(mix(cfg.seed ^ mix(block * 2 + 1))),
+            keyStep(std::max<uint64_t>(UINT64_MAX / std::max<uint64_t>(cfg.recordCount, 1), 1)) {}
 
-        DataHeader dataHeader(0, data.size());
-        getRandKey(dataHeader.key);
+    uint64_t payloadSize() {
+        switch (config.payload) {
+            case FixedPayload:
+                return config.payloadMin;
+            case UniformPayload:
+                return std::uniform_int_distribution<uint64_t>(config.payloadMin, config.payloadMax)(payloadRandom);
+            case ExponentialPayload:
+                return static_cast<uint64_t>(std::exponential_distribution<double>(1 / config.payloadMean)(payloadRandom));
+        }
+
+        return 0;
+    }
+
+    void createKey(uint64_t index, Key& key) {
+        switch (config.keys) {
+            case UniformKeys:
+                randomKey(key);
+                break;
+            case ZipfKeys:
+                // Ranks are scattered over key space, so frequent keys aren't the smallest ones
+                valueKey(mix(zipfRank()), key);
+                break;
+            case SortedKeys:
+                orderedKey(index * keyStep, key);
+                break;
+            case ReverseKeys:
+                orderedKey((config.recordCount - 1 - index) * keyStep, key);
+                break;
+            case NearlySortedKeys:
+                if (std::uniform_real_distribution<double>()(keyRandom) < config.disorder) {
+                    randomKey(key);
+                } else {
+                    orderedKey(index * keyStep, key);
+                }
+                break;
+            case DuplicateKeys:
+                valueKey(mix(std::uniform_int_distribution<uint64_t>(1, config.distinctKeys)(keyRandom)), key);
+                break;
+        }
+    }
+
+private:
+    void randomKey(Key& key) {
+        for (size_t i = 0; i < key.size(); i += sizeof(uint64_t)) {
+            uint64_t value = keyRandom();
+            memcpy(&key[i], &value, std::min(sizeof(value), key.size() - i));
+        }
+    }
+
+    // Big-endian value in the beginning of key, so keys are ordered as values
+    void valueKey(uint64_t value, Key& key) {
+        memset(&key.front(), 0, key.size());
+        for (size_t i = 0; i < std::min(sizeof(value), key.size()); ++i) {
+            key[i] = static_cast<unsigned char>(value >> (56 - 8 * i));
+        }
+    }
+
+    void orderedKey(uint64_t value, Key& key) {
+        randomKey(key);
+        for (size_t i = 0; i < std::min(sizeof(value), key.size()); ++i) {
+            key[i] = static_cast<unsigned char>(value >> (56 - 8 * i));
+        }
+    }
+
+    // Rank in [1, distinctKeys] with probability about rank^-skew. Inversion of continuous
+    // bounded power law, needs no table for large key counts.
+    uint64_t zipfRank() {
+        const double u = std::uniform_real_distribution<double>()(keyRandom);
+        const double n = static_cast<double>(config.distinctKeys) + 1;
+
+        double rank;
+        if (std::fabs(config.zipfSkew - 1) < 1e-9) {
+            rank = std::pow(n, u);
+        } else {
+            const double exponent = 1 - config.zipfSkew;
+            rank = std::pow((std::pow(n, exponent) - 1) * u + 1, 1 / exponent);
+        }
+
+        return std::min<uint64_t>(std::max<uint64_t>(static_cast<uint64_t>(rank), 1), config.distinctKeys);
+    }
+
+private:
+    const Config& config;
+    std::mt19937_64 keyRandom;
+    std::mt19937_64 payloadRandom;
+    const uint64_t keyStep;
+};
+
+uint64_t blockRecords(const Config& config, size_t block) {
+    return std::min<uint64_t>(BLOCK_RECORDS, config.recordCount - block * BLOCK_RECORDS);
+}
 
-        DataEntry entry(dataHeader, data);
+uint64_t blockSize(const Config& config, size_t block) {
+    RecordGenerator generator(config, block);
+
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < blockRecords(config, block); ++i) {
+        size += sizeof(DataHeader) + generator.payloadSize();
+    }
+
+    return size;
+}
+
+void writeAt(int fd, const std::vector<char>& buffer, size_t size, uint64_t offset, const char* fileName) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, &buffer[written], size - written, offset + written);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw Exception() << "Can't write to file" << fileName << strerror(errno);
+        }
+
+        written += res;
+    }
+}
+
+void writeBlock(int fd, const Config& config, size_t block, uint64_t offset, const char* fileName) {
+    RecordGenerator generator(config, block);
+    MemoryOutArchive archive;
+
+    DataEntry entry;
+    const uint64_t firstIndex = block * BLOCK_RECORDS;
+    for (uint64_t i = 0; i < blockRecords(config, block); ++i) {
+        // Payload sizes are drawn in the same order as by blockSize
+        uint64_t size = generator.payloadSize();
+        generator.createKey(firstIndex + i, entry.header.key);
+
+        entry.header.dataSize = size;
+        entry.data.assign(size, 0);
 
         serialize(entry, archive);
     }
+
+    writeAt(fd, archive.getBuffer(), archive.pos(), offset, fileName);
+}
+
+void createTestData(const char* outFileName, const Config& config, ThreadPool& threadPool) {
+    const size_t blockCount = (config.recordCount + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+
+    std::vector<uint64_t> offsets(blockCount + 1, 0);
+    parallelFor(threadPool, 0, blockCount, [&](size_t block) {
+        offsets[block + 1] = blockSize(config, block);
+    });
+
+    for (size_t block = 0; block < blockCount; ++block) {
+        offsets[block + 1] += offsets[block];
+    }
+
+    int fd = open(outFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw Exception() << "Can't open file" << outFileName << strerror(errno);
+    }
+
+    try {
+        if (ftruncate(fd, offsets.back()) != 0) {
+            throw Exception() << "Can't resize file" << outFileName << strerror(errno);
+        }
+
+        parallelFor(threadPool, 0, blockCount, [&](size_t block) {
+            writeBlock(fd, config, block, offsets[block], outFileName);
+        });
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) != 0) {
+        throw Exception() << "Can't close file" << outFileName << strerror(errno);
+    }
 }
 
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
+    CommandLine commandLine(argc, argv);
+
+    if (commandLine.argCount() != 2) {
         printUsage();
         return 1;
     }
 
-    size_t recordCount = atoi(argv[1]);
-
     try {
-        createTestData(argv[2], recordCount);
+        std::set<std::string> optionNames;
+        optionNames.insert("threads");
+        optionNames.insert("seed");
+        optionNames.insert("keys");
+        optionNames.insert("distinct-keys");
+        optionNames.insert("zipf-skew");
+        optionNames.insert("disorder");
+        optionNames.insert("payload");
+        commandLine.checkOptions(optionNames);
+
+        Config config;
+        config.recordCount = std::stoull(commandLine.arg(0));
+        config.seed = commandLine.option<uint64_t>("seed", 1);
+        config.keys = parseKeyDistribution(commandLine.option("keys", "uniform"));
+        config.distinctKeys = commandLine.option<uint64_t>("distinct-keys", config.keys == ZipfKeys ? 1000000 : 100);
+        config.zipfSkew = commandLine.option<double>("zipf-skew", 1);
+        config.disorder = commandLine.option<double>("disorder", 0.01);
+        parsePayloadDistribution(commandLine.option("payload", "uniform:0:99"), config);
+
+        if (!config.distinctKeys) {
+            throw Exception() << "Distinct keys count must be positive";
+        }
+
+        if (config.zipfSkew <= 0) {
+            throw Exception() << "Zipf skew must be positive";
+        }
+
+        ThreadPool threadPool(commandLine.option<size_t>("threads", std::max(std::thread::hardware_concurrency(), 1u)));
+
+        createTestData(commandLine.arg(1), config, threadPool);
     } catch (std::exception& ex) {
         std::cerr << ex.what() << "\n";
         return 1;
@@ -1,137 +1,525 @@
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
-#include <sys/time.h>
-#include <vector>
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <cassert>
+#include <list>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#include <iteratorreader.h>
-#include <iteratorwriter.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmdline.h>
+#include <data.h>
+#include <exception.h>
+#include <filearchive.h>
+#include <index.h>
 #include <merger.h>
+#include <metrics.h>
+#include <noncopyable.h>
+#include <sortcmdline.h>
+#include <sorter.h>
+#include <threadpool.h>
+
+namespace {
+
+void printUsage() {
+    std::cout << "Usage: performance_test work_dir [options]\n";
+    std::cout << "Options:\n"
+        "  --benchmarks=list        comma separated subset of write,read,sort,merge,merge_files,runs,sort_chunks,sort_file,index\n"
+        "  --items=count            entries in generated data, default 1000000\n"
+        "  --payload=list           payload bytes of entry, default 50\n"
+        "  --fan-in=list            runs merged by merge and merge_files, default 2,16,128\n"
+        "  --chunk-items=list       entries in chunk for sort, runs, sort_chunks, sort_file and index, default 100000\n"
+        "  --threads=list           pool threads for runs, sort_chunks, sort_file and index, default 1 and number of cores\n"
+        "  --repeat=count           measured repetitions, default 5\n"
+        "  --warmup=count           repetitions before measured ones, default 1\n"
+        "  --seed=number            seed of generated data, default 1\n"
+        "  --json=file_name         write results as JSON\n";
+}
 
-struct TestStruct {
-    TestStruct() {
-        data = "111111111111111111111111111111111111111111111111111111111111111111111111111111111111111";
+// Comma separated sizes with optional K, M or G suffix
+std::vector<uint64_t> parseSizeList(const std::string& value) {
+    std::vector<uint64_t> sizes;
+
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = std::min(value.find(',', begin), value.size());
+        sizes.push_back(parseSize(value.substr(begin, end - begin)));
+        begin = end + 1;
     }
 
-    TestStruct(int k) :
-            key(k) {
-        data = "111111111111111111111111111111111111111111111111111111111111111111111111111111111111111";
+    return sizes;
+}
+
+std::set<std::string> parseNameList(const std::string& value) {
+    std::set<std::string> names;
+
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = std::min(value.find(',', begin), value.size());
+        names.insert(value.substr(begin, end - begin));
+        begin = end + 1;
     }
 
-    bool operator < (const TestStruct& other) const {
-        return key < other.key;
+    return names;
+}
+
+void makeDirectory(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw Exception() << "Can't create directory" << dir << strerror(errno);
     }
+}
 
-    bool operator > (const TestStruct& other) const {
-        return key > other.key;
+// Removes chunk files left by previous repetition
+void clearDirectory(const std::string& dir) {
+    DIR* dirPtr = opendir(dir.c_str());
+    if (!dirPtr) {
+        throw Exception() << "Can't open directory" << dir << strerror(errno);
     }
 
-    bool operator <= (const TestStruct& other) const {
-        return key <= other.key;
+    while (dirent* entry = readdir(dirPtr)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+            unlink((dir + "/" + name).c_str());
+        }
     }
 
-    int operator()() const {
-        return key;
+    closedir(dirPtr);
+}
+
+std::vector<DataEntry> createEntries(size_t count, size_t payloadSize, uint64_t seed) {
+    std::mt19937_64 random(seed);
+
+    std::vector<DataEntry> entries(count);
+    for (DataEntry& entry : entries) {
+        for (size_t i = 0; i < entry.header.key.size(); ++i) {
+            entry.header.key[i] = random();
+        }
+
+        entry.header.dataSize = payloadSize;
+        entry.data.assign(payloadSize, static_cast<char>(random()));
+    }
+
+    return entries;
+}
+
+uint64_t serializedSize(const std::vector<DataEntry>& entries) {
+    uint64_t size = 0;
+    for (const DataEntry& entry : entries) {
+        size += sizeof(DataHeader) + entry.data.size();
     }
 
-    int key;
-    std::string data;
+    return size;
+}
+
+// Merge run over sorted entries in memory, so Merger is measured without I/O
+struct VectorRun {
+    const std::vector<DataEntry>* entries;
+    size_t pos;
 };
 
-void testMerge() {
-    //const size_t MAX_ARRAYS = 1000;
-    const size_t MAX_VECTOR_SIZE = 1000000;
-    const size_t MAX_VALUE = 10000;
+bool readMergeItem(DataEntry& entry, VectorRun& run) {
+    if (run.pos == run.entries->size()) {
+        return false;
+    }
 
-    typedef TestStruct ItemType;
+    entry = (*run.entries)[run.pos++];
+    return true;
+}
 
-    typedef std::vector<ItemType>::iterator VectorIterator;
-    typedef std::vector<ItemType>::const_iterator VectorConstIterator;
+struct Statistics {
+    double min;
+    double median;
+    double mean;
+    double stddev;
+};
 
-    while (true) {
-        /*size_t size = rand() % MAX_ARRAYS;
-        if (!size) {
-            size = 2;
-        }*/
+Statistics statistics(std::vector<double> times) {
+    std::sort(times.begin(), times.end());
 
-        size_t size = 2;
+    Statistics stat;
+    stat.min = times.front();
+    stat.median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
 
-        std::list< IteratorReader<VectorConstIterator> > readers;
+    double sum = 0;
+    for (double time : times) {
+        sum += time;
+    }
+    stat.mean = sum / times.size();
 
-        std::list< std::vector<ItemType> > dataList;
+    double squares = 0;
+    for (double time : times) {
+        squares += (time - stat.mean) * (time - stat.mean);
+    }
+    stat.stddev = times.size() > 1 ? std::sqrt(squares / (times.size() - 1)) : 0;
 
-        size_t outputSize = 0;
+    return stat;
+}
 
-        for (size_t i = 0; i < size; ++i) {
-            //size_t vectorSize = rand() % MAX_VECTOR_SIZE;
-            size_t vectorSize = MAX_VECTOR_SIZE;
+struct Result {
+    Result(const std::string& benchmarkName, uint64_t itemCount, uint64_t byteCount) :
+            name(benchmarkName),
+            items(itemCount),
+            bytes(byteCount) {}
 
-            outputSize += vectorSize;
+    Result& param(const std::string& paramName, uint64_t value) {
+        params.push_back(std::make_pair(paramName, value));
+        return *this;
+    }
 
-            std::vector<ItemType> vec;
-            for (size_t j = 0; j < vectorSize; ++j) {
-                vec.push_back(ItemType(rand() % MAX_VALUE));
+    std::string name;
+    std::vector< std::pair<std::string, uint64_t> > params;
+    uint64_t items;
+    uint64_t bytes;
+    std::vector<double> times;
+};
+
+// Runs every case warmup + repeat times, reports statistics of measured repetitions.
+// Throughput is computed from median time.
+class Benchmark : Noncopyable {
+public:
+    Benchmark(size_t warmupCount, size_t repeatCount) :
+            warmup(warmupCount),
+            repeat(std::max<size_t>(repeatCount, 1)) {}
+
+    // Setup is called before every repetition and isn't measured
+    template <typename Setup, typename Function>
+    void run(Result result, Setup setup, Function function) {
+        for (size_t i = 0; i < warmup + repeat; ++i) {
+            setup();
+
+            _Impl::Stopwatch stopwatch;
+            function();
+            double time = stopwatch.wallTime();
+
+            if (i >= warmup) {
+                result.times.push_back(time);
             }
+        }
 
-            std::sort(vec.begin(), vec.end());
+        print(result);
+        results.push_back(result);
+    }
 
-            /*std::copy(vec.begin(), vec.end(), std::ostream_iterator<int>(std::cout, " "));
-            std::cout << "\n";*/
+    template <typename Function>
+    void run(const Result& result, Function function) {
+        run(result, []() {}, function);
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << "{\n  \"benchmarks\": [";
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& result = results[i];
+            Statistics stat = statistics(result.times);
 
-            dataList.push_back(vec);
-            readers.push_back(IteratorReader<VectorConstIterator>(dataList.back().begin(), dataList.back().end()));
+            out << (i ? ",\n" : "\n");
+            out << "    {\"name\": \"" << result.name << "\", \"params\": {";
+            for (size_t p = 0; p < result.params.size(); ++p) {
+                out << (p ? ", " : "") << "\"" << result.params[p].first << "\": " << result.params[p].second;
+            }
+            out << "}, \"items\": " << result.items << ", \"bytes\": " << result.bytes << ", \"times\": [";
+            for (size_t t = 0; t < result.times.size(); ++t) {
+                out << (t ? ", " : "") << result.times[t];
+            }
+            out << "], \"min\": " << stat.min << ", \"median\": " << stat.median << ", \"mean\": " << stat.mean
+                << ", \"stddev\": " << stat.stddev << ", \"mb_per_s\": " << rate(result.bytes, stat.median) / (1 << 20)
+                << ", \"items_per_s\": " << rate(result.items, stat.median) << "}";
         }
 
-        std::vector<ItemType> output(outputSize, 0);
-        IteratorWriter<VectorIterator> writer(output.begin());
+        out << (results.empty() ? "]\n" : "\n  ]\n");
+        out << "}\n";
+    }
+
+private:
+    static double rate(uint64_t amount, double seconds) {
+        return seconds > 0 ? amount / seconds : 0;
+    }
 
-        struct timeval start, end;
+    void print(const Result& result) const {
+        Statistics stat = statistics(result.times);
 
-        //std::cout << "Start\n";
+        std::cout << result.name;
+        for (const std::pair<std::string, uint64_t>& param : result.params) {
+            std::cout << " " << param.first << "=" << param.second;
+        }
 
-        gettimeofday(&start, NULL);
+        std::cout << ": median " << stat.median << " s, min " << stat.min << " s, mean " << stat.mean
+            << " s, stddev " << (stat.mean > 0 ? stat.stddev / stat.mean * 100 : 0) << "%, "
+            << rate(result.bytes, stat.median) / (1 << 20) << " MB/s, "
+            << rate(result.items, stat.median) / 1e6 << " M items/s\n";
+    }
 
-#if 1
-        Merger<ItemType, IteratorReader<VectorConstIterator>, IteratorWriter<VectorIterator> > merger(readers, writer);
-        merger.merge();
-#else
-        std::merge(dataList.front().begin(), dataList.front().end(),
-                   dataList.back().begin(), dataList.back().end(),
-                   output.begin());
-#endif
+private:
+    const size_t warmup;
+    const size_t repeat;
+    std::vector<Result> results;
+};
 
-        gettimeofday(&end, NULL);
+struct Config {
+    std::string workDir;
+    std::set<std::string> benchmarks;
+    uint64_t items;
+    std::vector<uint64_t> payloads;
+    std::vector<uint64_t> fanIns;
+    std::vector<uint64_t> chunkItems;
+    std::vector<uint64_t> threads;
+    uint64_t seed;
+
+    bool enabled(const std::string& name) const {
+        return benchmarks.count(name) != 0;
+    }
+};
 
-        int seconds  = end.tv_sec  - start.tv_sec;
-        int useconds = end.tv_usec - start.tv_usec;
+// Index entries of data entries in input order, chunkItems in every chunk file
+std::list<std::string> writeIndexChunks(const std::vector<DataEntry>& entries, const std::string& chunkDir, size_t chunkItems) {
+    std::list<std::string> chunkFiles;
 
-        int time = ((seconds) * pow(10, 6) + useconds);
+    for (size_t begin = 0; begin < entries.size(); begin += chunkItems) {
+        std::ostringstream fileName;
+        fileName << chunkDir << "/index_chunk_" << chunkFiles.size();
+        chunkFiles.push_back(fileName.str());
 
-        std::cout << time << "\n";
+        FileOutArchive outArchive(fileName.str());
+        const size_t end = std::min(begin + chunkItems, entries.size());
+        for (size_t i = begin; i < end; ++i) {
+            serialize(IndexEntry(entries[i].header.key, i), outArchive);
+        }
+    }
+
+    return chunkFiles;
+}
+
+void runBenchmarks(const Config& config, uint64_t payload, Benchmark& benchmark) {
+    const std::string dataFileName = config.workDir + "/data.dat";
+    const std::string outputFileName = config.workDir + "/output.dat";
+    const std::string chunkDir = config.workDir + "/chunks";
 
-        //assert(!readers.empty());
-        //assert(!output.empty());
+    makeDirectory(chunkDir);
 
-        /*std::cout << "output\n";
-        std::copy(output.begin(), output.end(), std::ostream_iterator<int>(std::cout, " "));
-        std::cout << "\n";*/
+    const std::vector<DataEntry> entries = createEntries(config.items, payload, config.seed);
+    const uint64_t bytes = serializedSize(entries);
 
-        if (!output.empty()) {
-            for (size_t i = 0; i < output.size() - 1; ++i) {
-                assert(output[i] <= output[i + 1]);
+    // Data file is needed by the following benchmarks, they read it from page cache
+    auto writeData = [&]() {
+        FileOutArchive outArchive(dataFileName);
+        for (const DataEntry& entry : entries) {
+            serialize(entry, outArchive);
+        }
+    };
+
+    if (config.enabled("write")) {
+        benchmark.run(Result("write", entries.size(), bytes).param("payload", payload), writeData);
+    } else {
+        writeData();
+    }
+
+    if (config.enabled("read")) {
+        benchmark.run(Result("read", entries.size(), bytes).param("payload", payload), [&]() {
+            FileInArchive inArchive(dataFileName);
+            DataEntry entry;
+            size_t count = 0;
+            while (!inArchive.eof()) {
+                deserialize(entry, inArchive);
+                ++count;
+            }
+
+            if (count != entries.size()) {
+                throw Exception() << "Read" << count << "entries instead of" << entries.size();
+            }
+        });
+    }
+
+    if (config.enabled("sort")) {
+        for (uint64_t chunkItems : config.chunkItems) {
+            const size_t count = std::min<size_t>(chunkItems, entries.size());
+            std::vector<DataEntry> chunk;
+
+            benchmark.run(Result("sort", count, bytes / entries.size() * count).param("payload", payload).param("chunk_items", chunkItems),
+                    [&]() {
+                chunk.assign(entries.begin(), entries.begin() + count);
+            }, [&]() {
+                _Impl::DefaultSortFunction()(chunk.begin(), chunk.end());
+            });
+        }
+    }
+
+    if (config.enabled("merge")) {
+        for (uint64_t fanIn : config.fanIns) {
+            std::vector< std::vector<DataEntry> > runs(fanIn);
+            for (size_t i = 0; i < entries.size(); ++i) {
+                runs[i % fanIn].push_back(entries[i]);
+            }
+
+            for (std::vector<DataEntry>& run : runs) {
+                std::sort(run.begin(), run.end());
             }
-        } else {
-            //std::cerr << "Empty result\n";
+
+            std::list<VectorRun> sources;
+            for (const std::vector<DataEntry>& run : runs) {
+                sources.push_back(VectorRun{&run, 0});
+            }
+
+            benchmark.run(Result("merge", entries.size(), bytes).param("payload", payload).param("fan_in", fanIn), [&]() {
+                Merger<DataEntry, VectorRun> merger(sources);
+
+                size_t count = 0;
+                merger.merge([&count](const DataEntry&) {
+                    ++count;
+                });
+
+                if (count != entries.size()) {
+                    throw Exception() << "Merged" << count << "entries instead of" << entries.size();
+                }
+            });
         }
+    }
+
+    if (config.enabled("merge_files")) {
+        for (uint64_t fanIn : config.fanIns) {
+            clearDirectory(chunkDir);
+
+            std::list<std::string> chunkFiles;
+            createAndSortChunksInPlace<DataEntry>(dataFileName.c_str(), chunkDir.c_str(), chunkFiles,
+                    (entries.size() + fanIn - 1) / fanIn, 1);
+
+            // Chunks may hold a few entries more than asked, so fan-in is the real number of runs
+            benchmark.run(Result("merge_files", entries.size(), bytes).param("payload", payload)
+                    .param("fan_in", chunkFiles.size()), [&]() {
+                mergeChunks<DataEntry>(chunkFiles, outputFileName.c_str());
+            });
+        }
+    }
+
+    for (uint64_t threads : config.threads) {
+        ThreadPool threadPool(threads);
+
+        for (uint64_t chunkItems : config.chunkItems) {
+            if (config.enabled("runs")) {
+                benchmark.run(Result("runs", entries.size(), bytes).param("payload", payload).param("chunk_items", chunkItems)
+                        .param("threads", threads), [&]() {
+                    clearDirectory(chunkDir);
+                }, [&]() {
+                    std::list<std::string> chunkFiles;
+                    createAndSortChunksInPlace<DataEntry>(dataFileName.c_str(), chunkDir.c_str(), chunkFiles, chunkItems, threadPool);
+                });
+            }
 
-        std::cout << "OK\n";
+            // Unsorted uncompressed IndexEntry chunks are sorted in place
+            if (config.enabled("sort_chunks")) {
+                std::list<std::string> chunkFiles;
+                benchmark.run(Result("sort_chunks", entries.size(), entries.size() * sizeof(IndexEntry))
+                        .param("chunk_items", chunkItems).param("threads", threads), [&]() {
+                    clearDirectory(chunkDir);
+                    chunkFiles = writeIndexChunks(entries, chunkDir, chunkItems);
+                }, [&]() {
+                    sortChunks<IndexEntry>(chunkFiles, threadPool);
+                });
+            }
+
+            if (config.enabled("sort_file")) {
+                benchmark.run(Result("sort_file", entries.size(), bytes).param("payload", payload).param("chunk_items", chunkItems)
+                        .param("threads", threads), [&]() {
+                    clearDirectory(chunkDir);
+                }, [&]() {
+                    externalSort<DataEntry>(dataFileName.c_str(), chunkDir.c_str(), outputFileName.c_str(), chunkItems, threadPool);
+                });
+            }
 
-        //std::cout << "-------------------\n";
+            if (config.enabled("index")) {
+                benchmark.run(Result("index", entries.size(), bytes).param("payload", payload).param("chunk_items", chunkItems)
+                        .param("threads", threads), [&]() {
+                    clearDirectory(chunkDir);
+                }, [&]() {
+                    createIndex<DataEntry, IndexEntry>(dataFileName.c_str(), chunkDir.c_str(), outputFileName.c_str(), chunkItems,
+                            threadPool, [](const DataEntry& data, size_t filePos) {
+                        return IndexEntry(data.header.key, filePos);
+                    });
+                });
+            }
+        }
     }
+
+    clearDirectory(chunkDir);
+    std::remove(outputFileName.c_str());
+}
+
 }
 
 int main(int argc, char* argv[]) {
-    testMerge();
+    CommandLine commandLine(argc, argv);
+
+    if (commandLine.argCount() != 1) {
+        printUsage();
+        return 1;
+    }
+
+    try {
+        std::set<std::string> optionNames = parseNameList("benchmarks,items,payload,fan-in,chunk-items,threads,repeat,warmup,seed,json");
+        commandLine.checkOptions(optionNames);
+
+        std::ostringstream defaultThreads;
+        defaultThreads << "1," << std::max(std::thread::hardware_concurrency(), 1u);
+
+        Config config;
+        config.workDir = commandLine.arg(0);
+        config.benchmarks = parseNameList(commandLine.option("benchmarks", "write,read,sort,merge,merge_files,runs,sort_chunks,sort_file,index"));
+        config.items = commandLine.option<uint64_t>("items", 1000000);
+        config.payloads = parseSizeList(commandLine.option("payload", "50"));
+        config.fanIns = parseSizeList(commandLine.option("fan-in", "2,16,128"));
+        config.chunkItems = parseSizeList(commandLine.option("chunk-items", "100000"));
+        config.seed = commandLine.option<uint64_t>("seed", 1);
+
+        std::vector<uint64_t> threads = parseSizeList(commandLine.option("threads", defaultThreads.str()));
+        std::sort(threads.begin(), threads.end());
+        threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+        config.threads = threads;
+
+        if (!config.items) {
+            throw Exception() << "Items count must be positive";
+        }
+
+        for (uint64_t fanIn : config.fanIns) {
+            if (!fanIn) {
+                throw Exception() << "Fan-in must be positive";
+            }
+        }
+
+        for (uint64_t chunkItems : config.chunkItems) {
+            if (!chunkItems) {
+                throw Exception() << "Chunk items count must be positive";
+            }
+        }
+
+        makeDirectory(config.workDir);
+
+        Benchmark benchmark(commandLine.option<size_t>("warmup", 1), commandLine.option<size_t>("repeat", 5));
+
+        for (uint64_t payload : config.payloads) {
+            runBenchmarks(config, payload, benchmark);
+        }
+
+        std::string jsonFileName = commandLine.option("json");
+        if (!jsonFileName.empty()) {
+            std::ofstream jsonFile(jsonFileName.c_str());
+            benchmark.writeJson(jsonFile);
+            if (!jsonFile) {
+                throw Exception() << "Can't write results to" << jsonFileName;
+            }
+        }
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <data.h>
+#include <exception.h>
+#include <filearchive.h>
+#include <serializer.h>
+#include <shard.h>
+#include <sorter.h>
+#include <threadpool.h>
+
+// Sorts random data to shards and checks that shards have disjoint ordered key
+// ranges and about equal sizes.
+
+namespace {
+
+const size_t SHARD_COUNT = 4;
+// Allowed difference of shard size from average, part of average
+const double MAX_SHARD_DEVIATION = 0.1;
+
+void randomEntry(std::mt19937_64& random, DataEntry& entry) {
+    for (size_t byte = 0; byte < Key::SIZE; ++byte) {
+        entry.header.key[byte] = static_cast<unsigned char>(random());
+    }
+
+    entry.header.dataSize = random() % 100;
+    entry.data.assign(entry.header.dataSize, 0);
+}
+
+void randomEntry(std::mt19937_64& random, uint64_t& entry) {
+    entry = random();
+}
+
+template <typename EntryType>
+void createData(const std::string& fileName, size_t count) {
+    std::mt19937_64 random(count);
+    FileOutArchive outArchive(fileName);
+
+    EntryType entry;
+    for (size_t i = 0; i < count; ++i) {
+        randomEntry(random, entry);
+        serialize(entry, outArchive);
+    }
+    outArchive.flush();
+}
+
+template <typename EntryType>
+std::vector<EntryType> readShard(const std::string& fileName) {
+    std::vector<EntryType> entries;
+    if (!fileSize(fileName)) {
+        return entries;
+    }
+
+    FileInArchive inArchive(fileName);
+    while (!inArchive.eof()) {
+        EntryType entry;
+        deserialize(entry, inArchive);
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+template <typename EntryType>
+void checkShards(const std::string& outputFileName, size_t count) {
+    std::vector<size_t> sizes;
+    EntryType last = EntryType();
+    size_t total = 0;
+
+    for (size_t shard = 0; shard < SHARD_COUNT; ++shard) {
+        std::vector<EntryType> entries = readShard<EntryType>(shardFileName(outputFileName, shard));
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if ((total || i) && entries[i] < last) {
+                throw Exception() << "Entry" << i << "of shard" << shard << "is out of order";
+            }
+
+            last = entries[i];
+        }
+
+        sizes.push_back(entries.size());
+        total += entries.size();
+    }
+
+    if (total != count) {
+        throw Exception() << "Shards have" << total << "entries instead of" << count;
+    }
+
+    const double average = static_cast<double>(count) / SHARD_COUNT;
+    for (size_t shard = 0; shard < SHARD_COUNT; ++shard) {
+        if (std::abs(sizes[shard] - average) > average * MAX_SHARD_DEVIATION) {
+            throw Exception() << "Shard" << shard << "has" << sizes[shard] << "entries, average is" << average;
+        }
+    }
+
+    for (size_t shard = 0; shard < SHARD_COUNT; ++shard) {
+        std::remove(shardFileName(outputFileName, shard).c_str());
+    }
+    std::remove(shardManifestFileName(outputFileName).c_str());
+}
+
+template <typename EntryType>
+void testShards(const std::string& dir, size_t count, size_t itemsInChunk, ChunkCompression compression) {
+    std::cout << "Shards of " << count << " entries, " << itemsInChunk << " in chunk" <<
+            (compression == LzChunkCompression ? ", compressed chunks" : "") << "\n";
+
+    const std::string dataFileName = dir + "/data.dat";
+    const std::string outputFileName = dir + "/sorted.dat";
+
+    createData<EntryType>(dataFileName, count);
+
+    SortOptions options;
+    options.shardCount = SHARD_COUNT;
+    options.chunkCompression = compression;
+    options.removeChunks = true;
+
+    ThreadPool threadPool(4);
+    externalSort<EntryType>(dataFileName.c_str(), dir.c_str(), outputFileName.c_str(), itemsInChunk, threadPool,
+            _Impl::DefaultSortFunction(), _Impl::DefaultEventCallback(), options);
+
+    checkShards<EntryType>(outputFileName, count);
+
+    std::remove(dataFileName.c_str());
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    char dirTemplate[] = "/tmp/shard_test_XXXXXX";
+    const char* dir = argc > 1 ? argv[1] : mkdtemp(dirTemplate);
+    if (!dir) {
+        std::cerr << "Can't create directory\n";
+        return 1;
+    }
+
+    try {
+        testShards<DataEntry>(dir, 300000, 200, NoChunkCompression);
+        testShards<DataEntry>(dir, 300000, 50000, NoChunkCompression);
+        testShards<DataEntry>(dir, 300000, 70000, LzChunkCompression);
+        testShards<uint64_t>(dir, 1000000, 300000, NoChunkCompression);
+        testShards<uint64_t>(dir, 1000000, 3000, LzChunkCompression);
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+
+    if (argc <= 1) {
+        rmdir(dir);
+    }
+
+    std::cout << "Shards are balanced\n";
+
+    return 0;
+}
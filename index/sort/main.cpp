@@ -1,66 +1,79 @@
 #include <iostream>
 
+#include <cmdline.h>
 #include <data.h>
+#include <sortcmdline.h>
 #include <sorter.h>
 
 namespace {
 
 void printUsage() {
-    std::cout << "Usage: sort_file data_file_name tmp_data_dir items_in_chunk thread_count out_file_name\n";
+    std::cout << "Usage: sort_file data_file_name tmp_data_dir items_in_chunk thread_count out_file_name [metrics_file_name] [options]\n";
+    std::cout << "Data file name and out file name can be - for standard input and output\n";
+    std::cout << "tmp_data_dir can list several directories separated by ':', chunks are striped over them\n";
+    std::cout << sortOptionsUsage();
 }
 
 struct EventCallback {
+    explicit EventCallback(std::ostream& outStream) :
+            out(outStream) {}
+
     void operator()(SortEventType type, int param) {
         switch (type) {
             case BeginCreatingChunks:
-                std::cout << "Creating chunks..." << "\n";
+                out << "Creating chunks..." << "\n";
                 break;
             case DoneCreatingChunks:
-                std::cout << param << " chunks created\n";
+                out << param << " chunks created\n";
                 break;
             case BeginSortingChunks:
-                std::cout << "Sorting chunks..." << "\n";
+                out << "Sorting chunks..." << "\n";
                 break;
             case ChunkSorted:
-                std::cout << "Chunk " << param << " sorted\n";
+                out << "Chunk " << param << " sorted\n";
                 break;
             case EndSortingChunks:
-                std::cout << "Done" << "\n";
+                out << "Done" << "\n";
                 break;
             case BeginMergingChunks:
-                std::cout << "Merging chunks..." << "\n";
+                out << "Merging chunks..." << "\n";
                 break;
             case DoneMergingChunks:
-                std::cout << "Done" << "\n";
+                out << "Done" << "\n";
                 break;
         }
     }
-};
 
-struct Sort {
-    template <typename RandomAccessIterator>
-    void operator()(RandomAccessIterator begin, RandomAccessIterator end) {
-        std::sort(begin, end);
-    }
+    std::ostream& out;
 };
 
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
+    CommandLine commandLine(argc, argv);
+
+    if (commandLine.argCount() != 5 && commandLine.argCount() != 6) {
         printUsage();
         return 1;
     }
 
-    const char* dataFileName = argv[1];
-    const char* chunkDir = argv[2];
-    size_t itemsInChunk = atoi(argv[3]);
-    size_t threadCount = atoi(argv[4]);
-    const char* outputFileName = argv[5];
+    const char* dataFileName = commandLine.arg(0);
+    const char* chunkDir = commandLine.arg(1);
+    size_t itemsInChunk = atoi(commandLine.arg(2));
+    size_t threadCount = atoi(commandLine.arg(3));
+    const char* outputFileName = commandLine.arg(4);
 
     try {
+        SortMetrics metrics;
+        SortOptions options = parseSortOptions(commandLine, 5, &metrics);
+
+        // Keep standard output clean when sorted data is written there
+        std::ostream& messageStream = isStandardStream(outputFileName) ? std::cerr : std::cout;
+
         externalSort<DataEntry>(dataFileName, chunkDir, outputFileName,
-                itemsInChunk, threadCount, Sort(), EventCallback());
+                itemsInChunk, threadCount, _Impl::DefaultSortFunction(), EventCallback(messageStream), options);
+
+        writeMetrics(commandLine, 5, metrics);
     } catch (std::exception& ex) {
         std::cerr << ex.what() << "\n";
         return 1;
@@ -1,60 +1,402 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include <cmdline.h>
 #include <exception.h>
 #include <filearchive.h>
 #include <index.h>
+#include <memarchive.h>
+#include <metrics.h>
+#include <mmapper.h>
+#include <parallel.h>
+#include <paralleldecoder.h>
 #include <serializer.h>
+#include <sparseindex.h>
+#include <threadpool.h>
 
 namespace {
 
 void printUsage() {
-    std::cout << "Usage: test_result [index|sorted] file_name\n";
+    std::cout << "Usage: test_result [index|sorted] file_name [options]\n";
+    std::cout << "Options:\n"
+        "  --input=data_file_name   check that file has the same entries as data file it was made of\n"
+        "  --threads=count          verify ranges of files concurrently, default is number of cores\n"
+        "  --sparse-index           check sparse index file_name.sidx written with the file\n";
 }
 
+// Hash of serialized entry. Multiset hash of file is sum of entry hashes, so it doesn't
+// depend on order and counts duplicates.
+uint64_t entryHash(const char* data, size_t size) {
+    const uint64_t PRIME = 0x100000001b3ULL;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t word;
+        memcpy(&word, data + i * sizeof(uint64_t), sizeof(word));
+        hash = (hash ^ word) * PRIME;
+    }
+
+    for (size_t i = words * sizeof(uint64_t); i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * PRIME;
+    }
+
+    // Finalizer of splitmix64, sums of hashes of similar entries shouldn't collide
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+enum Failure {
+    NoFailure,
+    InvalidEntry,
+    WrongOrder
+};
+
+template <typename Entry>
+struct RangeResult {
+    RangeResult() :
+            decoded(false),
+            count(0),
+            hash(0),
+            failure(NoFailure),
+            failureIndex(0) {}
+
+    // Entries end exactly at range end
+    bool decoded;
+    uint64_t count;
+    uint64_t hash;
+    Entry first;
+    Entry last;
+    Failure failure;
+    // Index of failed entry in range
+    uint64_t failureIndex;
+};
+
+// HashFunction(entry, ptr, size, offset) gives hash of entry serialized at ptr, offset is from file begin
+template <typename Entry, typename HashFunction>
+void scanRange(const char* fileBegin, const char* begin, const char* end, bool checkOrder, HashFunction& hashFunction,
+        RangeResult<Entry>& result) {
+    MemoryInArchive inArchive(begin, end);
+
+    Entry entry;
+
+    try {
+        while (!inArchive.eof()) {
+            const char* ptr = begin + inArchive.pos();
+            deserialize(entry, inArchive);
+
+            if (!isValid(entry)) {
+                result.failure = InvalidEntry;
+                result.failureIndex = result.count;
+                return;
+            }
+
+            if (checkOrder && result.count && entry < result.last) {
+                result.failure = WrongOrder;
+                result.failureIndex = result.count;
+                return;
+            }
+
+            result.hash += hashFunction(entry, ptr, (begin + inArchive.pos()) - ptr, ptr - fileBegin);
+
+            if (!result.count) {
+                result.first = entry;
+            }
+
+            std::swap(result.last, entry);
+            ++result.count;
+        }
+    } catch (const std::exception&) {
+        // Entry crosses range end or range start is a wrong guess
+        return;
+    }
+
+    result.decoded = true;
+}
+
+// First entry start at or after ptr. Ranges of entries which are neither fixed size nor
+// splittable aren't split.
+template <typename Entry>
+const char* entryStart(const char* begin, const char* ptr, const char* end) {
+    if (IsBitwiseSerializable<Entry>::value) {
+        uint64_t offset = ptr - begin;
+        offset += (sizeof(Entry) - offset % sizeof(Entry)) % sizeof(Entry);
+        return begin + std::min<uint64_t>(offset, end - begin);
+    }
+
+    if (RecordBoundary<Entry>::splittable) {
+        return _Impl::findRecordBoundary<Entry>(ptr, end);
+    }
+
+    return end;
+}
+
+// Scans file by ranges concurrently. Cut of variable length entries is a guess, first
+// range which doesn't end exactly at the next cut is rescanned with the rest of file,
+// its start is a real entry start because all ranges before it are decoded.
+template <typename Entry, typename HashFunction>
+RangeResult<Entry> scanFile(const char* fileName, ThreadPool& threadPool, bool checkOrder, HashFunction hashFunction) {
+    ReadOnlyMemMapper mMapper(fileName);
+    mMapper.map();
+    mMapper.advise(MADV_SEQUENTIAL);
+
+    const char* begin = mMapper.getBeginPtr();
+    const char* end = mMapper.getEndPtr();
+
+    const size_t partCount = std::max<size_t>(threadPool.size(), 1) * 4;
+    const uint64_t size = end - begin;
+
+    std::vector<const char*> bounds(1, begin);
+    for (size_t part = 1; part <= partCount; ++part) {
+        const char* cut = begin + size * part / partCount;
+        bounds.push_back(cut == end ? end : entryStart<Entry>(begin, std::max(cut, bounds.back()), end));
+    }
+
+    std::vector< RangeResult<Entry> > parts(partCount);
+
+    parallelFor(threadPool, 0, partCount, [&](size_t part) {
+        scanRange<Entry>(begin, bounds[part], bounds[part + 1], checkOrder, hashFunction, parts[part]);
+    });
+
+    for (size_t part = 0; part < partCount; ++part) {
+        if (!parts[part].decoded && parts[part].failure == NoFailure) {
+            RangeResult<Entry> rest;
+            scanRange<Entry>(begin, bounds[part], end, checkOrder, hashFunction, rest);
+            if (!rest.decoded && rest.failure == NoFailure) {
+                // The last entry is cut
+                rest.failure = InvalidEntry;
+                rest.failureIndex = rest.count;
+            }
+
+            parts.resize(part);
+            parts.push_back(rest);
+            break;
+        }
+    }
+
+    RangeResult<Entry> result;
+    result.decoded = true;
+
+    for (RangeResult<Entry>& part : parts) {
+        if (checkOrder && result.count && part.count && part.first < result.last) {
+            result.failure = WrongOrder;
+            result.failureIndex = result.count;
+            return result;
+        }
+
+        if (part.failure != NoFailure) {
+            result.failure = part.failure;
+            result.failureIndex = result.count + part.failureIndex;
+            return result;
+        }
+
+        if (part.count) {
+            if (!result.count) {
+                result.first = part.first;
+            }
+
+            std::swap(result.last, part.last);
+        }
+
+        result.count += part.count;
+        result.hash += part.hash;
+    }
+
+    return result;
+}
+
+struct SerializedHash {
+    template <typename Entry>
+    uint64_t operator()(const Entry&, const char* ptr, size_t size, uint64_t) const {
+        return entryHash(ptr, size);
+    }
+};
+
+// Hash of index entry made of data entry by create_index
+struct IndexEntryHash {
+    uint64_t operator()(const DataEntry& data, const char*, size_t size, uint64_t offset) const {
+        IndexEntry entry(data.header.key, offset + size);
+        return entryHash(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    }
+};
+
 template <typename Entry>
-void test(const char* fileName) {
-    Entry prev;
+void checkResult(const RangeResult<Entry>& result) {
+    if (result.failure == InvalidEntry) {
+        throw Exception() << "Failed data in" << result.failureIndex << "position";
+    }
+
+    if (result.failure == WrongOrder) {
+        throw Exception() << "Failed order in" << result.failureIndex << "position";
+    }
+}
+
+template <typename Entry, typename InputHash>
+void test(const char* fileName, const char* inputFileName, ThreadPool& threadPool, InputHash inputHash) {
+    _Impl::Stopwatch stopwatch;
+
+    RangeResult<Entry> result = scanFile<Entry>(fileName, threadPool, true, SerializedHash());
+    checkResult(result);
+
+    std::cout << "Data is correct, " << result.count << " items\n";
+
+    uint64_t bytes = fileSize(fileName);
+
+    if (inputFileName) {
+        RangeResult<DataEntry> input = scanFile<DataEntry>(inputFileName, threadPool, false, inputHash);
+        checkResult(input);
+
+        if (input.count != result.count) {
+            throw Exception() << "Input has" << input.count << "items, output has" << result.count;
+        }
+
+        if (input.hash != result.hash) {
+            throw Exception() << "Content of output differs from input";
+        }
+
+        std::cout << "Content matches input\n";
+
+        bytes += fileSize(inputFileName);
+    }
 
-    FileInArchive inArchive(fileName);
+    double seconds = stopwatch.wallTime();
+    std::cout << "Verified " << bytes << " bytes in " << seconds << " s, "
+        << (seconds > 0 ? bytes / seconds / (1 << 20) : 0) << " MB/s\n";
+}
 
-    size_t count = 0;
+template <typename Key>
+bool equalKeys(const Key& a, const Key& b) {
+    return !(a < b) && !(b < a);
+}
 
-    while (!inArchive.eof()) {
+// Every indexed offset is the start of step-th entry with indexed key, lookup of every key
+// starts at entry start at most step entries before the first entry not less than the key,
+// split bounds are entry starts
+template <typename Entry>
+void testSparseIndex(const char* fileName) {
+    typedef typename SparseIndexKey<Entry>::KeyType KeyType;
+
+    SparseIndex<Entry> index(fileName);
+
+    std::vector<uint64_t> starts;
+    std::vector<KeyType> keys;
+    {
+        FileInArchive inArchive(fileName);
         Entry entry;
-        deserialize(entry, inArchive);
+        while (!inArchive.eof()) {
+            starts.push_back(inArchive.pos());
+            deserialize(entry, inArchive);
+            keys.push_back(SparseIndexKey<Entry>::get(entry));
+        }
+    }
 
-        if (!isValid(entry)) {
-            throw Exception() << "Failed data in" << count << "position";
+    auto entryIndex = [&starts](uint64_t offset) {
+        std::vector<uint64_t>::const_iterator it = std::lower_bound(starts.begin(), starts.end(), offset);
+        if (it == starts.end() || *it != offset) {
+            throw Exception() << "Sparse index offset" << offset << "isn't entry start";
         }
 
-        if (entry < prev) {
-            throw Exception() << "Failed order in" << count << "position";
+        return static_cast<uint64_t>(it - starts.begin());
+    };
+
+    const uint64_t step = index.step();
+    if (!step || index.entryCount() != starts.size() || index.sortedFileSize() != fileSize(fileName)) {
+        throw Exception() << "Sparse index header doesn't match file:" << index.entryCount() << "entries,"
+                << index.sortedFileSize() << "bytes";
+    }
+
+    const std::vector<KeyType>& indexedKeys = index.indexedKeys();
+    const std::vector<uint64_t>& indexedOffsets = index.indexedOffsets();
+    if (indexedKeys.size() != (starts.size() + step - 1) / step) {
+        throw Exception() << "Sparse index has" << indexedKeys.size() << "keys, step is" << step;
+    }
+
+    for (size_t i = 0; i < indexedKeys.size(); ++i) {
+        uint64_t entry = entryIndex(indexedOffsets[i]);
+        if (entry != i * step || !equalKeys(keys[entry], indexedKeys[i])) {
+            throw Exception() << "Sparse index key" << i << "doesn't match entry" << entry;
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        uint64_t scanStart = entryIndex(index.lowerBoundOffset(keys[i]));
+        uint64_t first = std::lower_bound(keys.begin(), keys.end(), keys[i]) - keys.begin();
+        if (scanStart > first || first - scanStart > step) {
+            throw Exception() << "Sparse index lookup of entry" << i << "starts at entry" << scanStart;
+        }
+    }
+
+    const size_t partCounts[] = {1, 2, 3, 7, 64, 1000};
+    for (size_t parts : partCounts) {
+        std::vector<uint64_t> bounds = index.split(parts);
+        if (bounds.front() != 0 || bounds.size() > parts + 1 || (starts.empty() ? bounds.size() != 1 :
+                bounds.back() != index.sortedFileSize())) {
+            throw Exception() << "Sparse index split into" << parts << "parts has wrong bounds";
         }
 
-        prev = entry;
+        for (size_t i = 1; i < bounds.size(); ++i) {
+            if (bounds[i] <= bounds[i - 1]) {
+                throw Exception() << "Sparse index split into" << parts << "parts isn't ordered";
+            }
 
-        ++count;
+            if (bounds[i] != index.sortedFileSize()) {
+                entryIndex(bounds[i]);
+            }
+        }
     }
 
-    std::cout << "Data is correct, " << count << " items\n";
+    std::cout << "Sparse index is correct, " << indexedKeys.size() << " keys\n";
 }
 
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
+    CommandLine commandLine(argc, argv);
+
+    if (commandLine.argCount() != 2) {
         printUsage();
         return 1;
     }
 
-    std::string entryType = argv[1];
-    const char* fileName = argv[2];
+    std::string entryType = commandLine.arg(0);
+    const char* fileName = commandLine.arg(1);
 
     try {
+        std::set<std::string> optionNames;
+        optionNames.insert("input");
+        optionNames.insert("threads");
+        optionNames.insert("sparse-index");
+        commandLine.checkOptions(optionNames);
+
+        std::string inputFileName = commandLine.option("input");
+        const char* inputFile = inputFileName.empty() ? 0 : inputFileName.c_str();
+
+        ThreadPool threadPool(commandLine.option<size_t>("threads", std::max(std::thread::hardware_concurrency(), 1u)));
+
+        const bool sparseIndex = commandLine.hasOption("sparse-index");
+
         if (entryType == "sorted") {
-            test<DataEntry>(fileName);
+            test<DataEntry>(fileName, inputFile, threadPool, SerializedHash());
+            if (sparseIndex) {
+                testSparseIndex<DataEntry>(fileName);
+            }
         } else if (entryType == "index") {
-            test<IndexEntry>(fileName);
+            test<IndexEntry>(fileName, inputFile, threadPool, IndexEntryHash());
+            if (sparseIndex) {
+                testSparseIndex<IndexEntry>(fileName);
+            }
         } else {
             throw Exception() << "Unknown entry type" << entryType;
         }
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <exception.h>
+#include <noncopyable.h>
+#include <serializer.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Bump allocator for payloads of one chunk. Memory is taken from large mapped blocks
+// and is freed all at once by reset, which keeps blocks for the next chunk. Not thread
+// safe, chunk is filled by one thread and handed over to another.
+class Arena : Noncopyable {
+    struct Block {
+        char* ptr;
+        size_t size;
+    };
+
+public:
+    enum {
+        DEFAULT_BLOCK_SIZE = 1 << 23,
+        HUGE_PAGE_SIZE = 1 << 21
+    };
+
+    // Huge pages are taken from reserved pool (MAP_HUGETLB) if possible, otherwise
+    // transparent huge pages are requested for blocks
+    explicit Arena(size_t blckSize = DEFAULT_BLOCK_SIZE, bool hugePgs = false) :
+            blockSize(hugePgs ? roundUp(blckSize, HUGE_PAGE_SIZE) : blckSize),
+            hugePages(hugePgs),
+            currentBlock(0),
+            blockUsed(0) {}
+
+    ~Arena() {
+        for (const Block& block : blocks) {
+            munmap(block.ptr, block.size);
+        }
+    }
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        while (currentBlock < blocks.size()) {
+            size_t offset = roundUp(blockUsed, alignment);
+            if (offset + size <= blocks[currentBlock].size) {
+                blockUsed = offset + size;
+                return blocks[currentBlock].ptr + offset;
+            }
+
+            ++currentBlock;
+            blockUsed = 0;
+        }
+
+        blocks.push_back(mapBlock(std::max<size_t>(size, blockSize)));
+        blockUsed = size;
+        return blocks.back().ptr;
+    }
+
+    // Frees all allocations. Blocks larger than block size are unmapped.
+    void reset() {
+        std::vector<Block> kept;
+        for (const Block& block : blocks) {
+            if (block.size == blockSize) {
+                kept.push_back(block);
+            } else {
+                munmap(block.ptr, block.size);
+            }
+        }
+
+        blocks.swap(kept);
+        currentBlock = 0;
+        blockUsed = 0;
+    }
+
+private:
+    static size_t roundUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    Block mapBlock(size_t size) {
+        Block block = {0, size};
+
+        if (hugePages) {
+            block.size = roundUp(size, HUGE_PAGE_SIZE);
+
+            void* ptr = mmap(0, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED) {
+                block.ptr = static_cast<char*>(ptr);
+                return block;
+            }
+        }
+
+        void* ptr = mmap(0, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            throw Exception() << "Can't map arena block of" << block.size << "bytes" << strerror(errno);
+        }
+
+        if (hugePages) {
+            madvise(ptr, block.size, MADV_HUGEPAGE);
+        }
+
+        block.ptr = static_cast<char*>(ptr);
+        return block;
+    }
+
+private:
+    const size_t blockSize;
+    const bool hugePages;
+    std::vector<Block> blocks;
+    size_t currentBlock;
+    size_t blockUsed;
+};
+
+// Allocates from arena if it is given, from heap otherwise. Deallocation of arena
+// memory does nothing. Copies of containers allocate from heap, so they may outlive
+// arena (e.g. samples of run), moved containers keep arena.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    ArenaAllocator() :
+            arena(0) {}
+
+    explicit ArenaAllocator(Arena* allocArena) :
+            arena(allocArena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) :
+            arena(other.arena) {}
+
+    T* allocate(size_t count) {
+        if (arena) {
+            return static_cast<T*>(arena->allocate(count * sizeof(T), alignof(T)));
+        }
+
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) {
+        if (!arena) {
+            ::operator delete(ptr);
+        }
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator();
+    }
+
+    Arena* arena;
+};
+
+template <typename T, typename U>
+bool operator == (const ArenaAllocator<T>& first, const ArenaAllocator<U>& second) {
+    return first.arena == second.arena;
+}
+
+template <typename T, typename U>
+bool operator != (const ArenaAllocator<T>& first, const ArenaAllocator<U>& second) {
+    return first.arena != second.arena;
+}
+
+// Reads entry with its heap parts allocated from arena, types with payload specialize it
+template <typename T>
+struct ArenaPlacement {
+    static const bool enabled = false;
+
+    template <typename InArchive>
+    static void read(T& item, InArchive& in, Arena&) {
+        deserialize(item, in);
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <chunkdir.h>
+#include <compressedarchive.h>
+#include <filearchive.h>
+#include <merger.h>
+#include <metrics.h>
+#include <noncopyable.h>
+#include <serializer.h>
+#include <threadpool.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Merges written chunk files in background while input is still read, so final merge
+// gets fewer, larger runs. Chunks have levels: fan-in chunks of one level are merged into
+// one chunk of the next level. One merge thread, a merge is started only when thread pool
+// has idle threads, so chunk sorting isn't delayed. Merge which isn't finished when input
+// ends is abandoned and its chunks are left to final merge.
+
+namespace _Impl {
+
+struct MergeAborted {};
+
+}
+
+template <typename EntryType>
+class BackgroundMerger : Noncopyable {
+public:
+    enum {
+        IDLE_CHECK_INTERVAL_MS = 10,
+        STOP_CHECK_ENTRIES = 4096
+    };
+
+    BackgroundMerger(const std::string& dir, size_t mergeFanIn, bool compressedChunks, uint64_t mmapWindowSize,
+            const ThreadPool& pool, _Impl::MetricsRecorder& metricsRecorder) :
+            chunkDir(dir),
+            fanIn(mergeFanIn),
+            compressed(compressedChunks),
+            windowSize(mmapWindowSize),
+            threadPool(pool),
+            recorder(metricsRecorder),
+            mergeCounter(0),
+            stopped(false),
+            mergeThread(&BackgroundMerger::mergeChunks, this) {}
+
+    ~BackgroundMerger() {
+        stop();
+    }
+
+    // Called when chunk file is written, from any thread
+    void chunkWritten(const std::string& fileName) {
+        std::unique_lock<std::mutex> lock(mutex);
+        addChunk(fileName, 0);
+        condition.notify_all();
+    }
+
+    // Stops merging and returns chunk files left, merged or not
+    std::list<std::string> finish() {
+        stop();
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        std::list<std::string> chunkFiles;
+        for (const std::list<std::string>& level : levels) {
+            chunkFiles.insert(chunkFiles.end(), level.begin(), level.end());
+        }
+
+        return chunkFiles;
+    }
+
+private:
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        condition.notify_all();
+
+        if (mergeThread.joinable()) {
+            mergeThread.join();
+        }
+    }
+
+    void addChunk(const std::string& fileName, size_t level) {
+        if (levels.size() <= level) {
+            levels.resize(level + 1);
+        }
+
+        levels[level].push_back(fileName);
+    }
+
+    // Lowest level with fan-in chunks
+    bool fullLevel(size_t& level) const {
+        for (level = 0; level < levels.size(); ++level) {
+            if (levels[level].size() >= fanIn) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool poolIdle() const {
+        return threadPool.tasksToDo() < threadPool.size();
+    }
+
+    void mergeChunks() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            size_t level = 0;
+
+            // Pool load isn't signalled, so it is polled
+            condition.wait_for(lock, std::chrono::milliseconds(IDLE_CHECK_INTERVAL_MS), [this, &level]() {
+                return stopped || (fullLevel(level) && poolIdle());
+            });
+
+            if (stopped || error) {
+                return;
+            }
+
+            if (!fullLevel(level) || !poolIdle()) {
+                continue;
+            }
+
+            std::list<std::string> inputs;
+            std::list<std::string>& levelChunks = levels[level];
+            for (size_t i = 0; i < fanIn; ++i) {
+                inputs.push_back(levelChunks.front());
+                levelChunks.pop_front();
+            }
+
+            std::string outputFileName = stripedChunkFileName(chunkDir, "merged_", mergeCounter++);
+
+            lock.unlock();
+
+            bool merged = false;
+            try {
+                merged = mergeGroup(inputs, outputFileName);
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                levels[level].splice(levels[level].end(), inputs);
+                return;
+            }
+
+            lock.lock();
+
+            if (merged) {
+                addChunk(outputFileName, level + 1);
+            } else {
+                levels[level].splice(levels[level].end(), inputs);
+            }
+        }
+    }
+
+    // Returns false if merge is abandoned, input chunks are kept then
+    bool mergeGroup(const std::list<std::string>& inputs, const std::string& outputFileName) {
+        _Impl::Stopwatch stopwatch;
+
+        bool merged = compressed ?
+                mergeFiles<CopyableCompressedFileInArchive, CompressedFileOutArchive>(inputs, outputFileName) :
+                mergeFiles<CopyableFileInArchive, FileOutArchive>(inputs, outputFileName);
+
+        if (!merged) {
+            std::remove(outputFileName.c_str());
+            return false;
+        }
+
+        uint64_t inputBytes = 0;
+        for (const std::string& fileName : inputs) {
+            inputBytes += fileSize(fileName);
+        }
+
+        uint64_t outputBytes = fileSize(outputFileName);
+
+        removeChunkFiles(inputs);
+
+        recorder.update([&](SortMetrics& m) {
+            ++m.intermediateMerges;
+            m.chunkBytesRead += inputBytes;
+            m.chunkBytesWritten += outputBytes;
+            m.ioWaitTime += stopwatch.waitTime();
+        });
+
+        return true;
+    }
+
+    template <typename InArchive, typename OutArchive>
+    bool mergeFiles(const std::list<std::string>& inputs, const std::string& outputFileName) {
+        std::list<InArchive> archives;
+        for (const std::string& fileName : inputs) {
+            archives.push_back(InArchive(fileName, windowSize, false));
+        }
+
+        OutArchive outArchive(outputFileName);
+
+        size_t counter = 0;
+        Merger<EntryType, InArchive> merger(archives);
+
+        try {
+            merger.merge([this, &outArchive, &counter](const EntryType& entry) {
+                if (++counter % STOP_CHECK_ENTRIES == 0 && stopped) {
+                    throw _Impl::MergeAborted();
+                }
+
+                serialize(entry, outArchive);
+            });
+        } catch (const _Impl::MergeAborted&) {
+            return false;
+        }
+
+        outArchive.flush();
+
+        return true;
+    }
+
+private:
+    const std::string chunkDir;
+    const size_t fanIn;
+    const bool compressed;
+    const uint64_t windowSize;
+    const ThreadPool& threadPool;
+    _Impl::MetricsRecorder& recorder;
+    size_t mergeCounter;
+    // Chunk files by level, level 0 are written chunks
+    std::vector< std::list<std::string> > levels;
+    std::exception_ptr error;
+    std::atomic<bool> stopped;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread mergeThread;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <arena.h>
+#include <noncopyable.h>
+#include <serializer.h>
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Entries of chunk and arena for their payloads if it is enabled
+template <typename EntryType>
+struct ChunkBuffer : Noncopyable {
+    explicit ChunkBuffer(Arena* payloadArena) :
+            arena(payloadArena) {}
+
+    // Entry decoded before keeps its payload memory, payloadArena is kept with the chunk if given
+    void add(EntryType&& entry, const std::shared_ptr<Arena>& payloadArena = std::shared_ptr<Arena>()) {
+        entries.push_back(std::move(entry));
+
+        if (payloadArena && (decodeArenas.empty() || decodeArenas.back() != payloadArena)) {
+            decodeArenas.push_back(payloadArena);
+        }
+    }
+
+    // Returns entry read from archive, its payload is read into arena if it is enabled
+    template <typename InArchive>
+    EntryType& read(InArchive& in) {
+        entries.push_back(EntryType());
+
+        if (arena) {
+            ArenaPlacement<EntryType>::read(entries.back(), in, *arena);
+        } else {
+            deserialize(entries.back(), in);
+        }
+
+        return entries.back();
+    }
+
+    // Entries are destroyed before their payload memory is freed
+    void clear() {
+        entries.clear();
+        decodeArenas.clear();
+
+        if (arena) {
+            arena->reset();
+        }
+    }
+
+    std::unique_ptr<Arena> arena;
+    std::vector<EntryType> entries;
+    // Arenas of payloads of entries decoded by parallelDecode
+    std::vector< std::shared_ptr<Arena> > decodeArenas;
+};
+
+// Recycles chunk buffers, so entry arrays and arena blocks of chunks written before
+// are reused instead of being allocated and grown again for every chunk
+template <typename EntryType>
+class ChunkBufferPool : Noncopyable {
+public:
+    typedef std::unique_ptr< ChunkBuffer<EntryType> > BufferPtr;
+
+    ChunkBufferPool(size_t maxFreeBuffers, bool payloadArena, bool hugePages) :
+            maxFree(maxFreeBuffers),
+            useArena(payloadArena && ArenaPlacement<EntryType>::enabled),
+            arenaHugePages(hugePages) {}
+
+    BufferPtr acquire() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!freeBuffers.empty()) {
+                BufferPtr buffer = std::move(freeBuffers.back());
+                freeBuffers.pop_back();
+                return buffer;
+            }
+        }
+
+        return BufferPtr(new ChunkBuffer<EntryType>(useArena ? new Arena(Arena::DEFAULT_BLOCK_SIZE, arenaHugePages) : 0));
+    }
+
+    // Called by sort task when chunk is written
+    void release(BufferPtr buffer) {
+        buffer->clear();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeBuffers.size() < maxFree) {
+            freeBuffers.push_back(std::move(buffer));
+        }
+    }
+
+private:
+    const size_t maxFree;
+    const bool useArena;
+    const bool arenaHugePages;
+    std::vector<BufferPtr> freeBuffers;
+    std::mutex mutex;
+};
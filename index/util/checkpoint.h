@@ -0,0 +1,287 @@
+#pragma once
+
+#include <checksum.h>
+#include <chunkdir.h>
+#include <exception.h>
+#include <filearchive.h>
+#include <mmapper.h>
+#include <noncopyable.h>
+#include <shard.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Checkpoint of external sort is checkpoint.manifest text file in the first chunk directory:
+//   input <size> <mtime> <items in chunk> <chunk compression>
+//   chunk <index> <input begin> <input end> <entries> <bytes> <checksum> <file name>
+//   merged <bytes> <output file name>
+//   shard <shard count> <index> <entries> <bytes> <first key or -> <last key or -> <file name>
+// Manifest is rewritten after every finished chunk or shard. Sort started with
+// the same input and parameters reuses chunks which are still intact.
+
+// Chunks written by sort get checksum from their archive, it is verified on resume
+inline uint64_t fileChecksum(const std::string& fileName) {
+    ReadOnlyMemMapper mMapper(fileName);
+    mMapper.map();
+    mMapper.advise(MADV_SEQUENTIAL);
+
+    return checksum(mMapper.getBeginPtr(), mMapper.getEndPtr() - mMapper.getBeginPtr());
+}
+
+struct CheckpointChunk {
+    CheckpointChunk() :
+            index(0),
+            inputBegin(0),
+            inputEnd(0),
+            entries(0),
+            bytes(0),
+            checksum(0) {}
+
+    size_t index;
+    // Input byte range [inputBegin, inputEnd) the chunk was made of
+    uint64_t inputBegin;
+    uint64_t inputEnd;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t checksum;
+    std::string fileName;
+};
+
+class SortCheckpoint : Noncopyable {
+public:
+    SortCheckpoint(const std::string& chunkDir, const std::string& inputFileName, size_t itemsInChunk, int chunkCompression) :
+            manifestFileName(firstChunkDir(chunkDir) + "/checkpoint.manifest"),
+            inputSize(0),
+            inputTime(0),
+            chunkSize(itemsInChunk),
+            compression(chunkCompression),
+            mergedBytes(0),
+            shardCount(0) {
+        struct stat fileStat;
+        if (stat(inputFileName.c_str(), &fileStat) != 0) {
+            throw Exception() << "Can't stat file" << inputFileName << strerror(errno);
+        }
+
+        inputSize = fileStat.st_size;
+        inputTime = fileStat.st_mtime;
+
+        load();
+        save();
+    }
+
+    // Verified chunks made of input prefix, in order
+    const std::vector<CheckpointChunk>& completedChunks() const {
+        return reusedChunks;
+    }
+
+    // Input offset to continue from
+    uint64_t resumeOffset() const {
+        return reusedChunks.empty() ? 0 : reusedChunks.back().inputEnd;
+    }
+
+    void chunkDone(const CheckpointChunk& chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        chunks[chunk.index] = chunk;
+
+        // Output made of other chunks is stale
+        mergedFileName.clear();
+        shards.clear();
+
+        save();
+    }
+
+    bool mergeDone(const std::string& outputFileName) const {
+        std::unique_lock<std::mutex> lock(mutex);
+        return outputFileName == mergedFileName && intactFile(outputFileName, mergedBytes);
+    }
+
+    void setMerged(const std::string& outputFileName, uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        mergedFileName = outputFileName;
+        mergedBytes = bytes;
+        save();
+    }
+
+    // All shards and their manifest are written, chunks may be removed already
+    bool shardsDone(size_t count, const std::string& outputFileName) const {
+        ShardInfo shard;
+        for (size_t index = 0; index < count; ++index) {
+            if (!shardDone(count, index, shardFileName(outputFileName, index), shard)) {
+                return false;
+            }
+        }
+
+        struct stat fileStat;
+        return stat(shardManifestFileName(outputFileName).c_str(), &fileStat) == 0;
+    }
+
+    // Fills shard if it was written completely with the same shard count
+    bool shardDone(size_t count, size_t index, const std::string& fileName, ShardInfo& shard) const {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::map<size_t, ShardInfo>::const_iterator it = shards.find(index);
+        if (count != shardCount || it == shards.end() || it->second.fileName != fileName || !intactFile(fileName, it->second.bytes)) {
+            return false;
+        }
+
+        shard = it->second;
+        return true;
+    }
+
+    void setShardDone(size_t count, size_t index, const ShardInfo& shard) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (count != shardCount) {
+            shards.clear();
+            shardCount = count;
+        }
+        shards[index] = shard;
+        save();
+    }
+
+private:
+    static bool intactFile(const std::string& fileName, uint64_t bytes) {
+        struct stat fileStat;
+        return stat(fileName.c_str(), &fileStat) == 0 && static_cast<uint64_t>(fileStat.st_size) == bytes;
+    }
+
+    static std::string keyField(const std::string& key) {
+        return key.empty() ? "-" : key;
+    }
+
+    static std::string keyValue(const std::string& field) {
+        return field == "-" ? std::string() : field;
+    }
+
+    static bool intactChunk(const CheckpointChunk& chunk) {
+        return intactFile(chunk.fileName, chunk.bytes) && fileChecksum(chunk.fileName) == chunk.checksum;
+    }
+
+    void load() {
+        std::ifstream in(manifestFileName.c_str());
+        if (!in) {
+            return;
+        }
+
+        std::string line;
+        if (!std::getline(in, line)) {
+            return;
+        }
+
+        std::istringstream header(line);
+        std::string tag;
+        uint64_t size = 0;
+        int64_t time = 0;
+        size_t itemsInChunk = 0;
+        int chunkCompression = 0;
+        if (!(header >> tag >> size >> time >> itemsInChunk >> chunkCompression) || tag != "input" ||
+                size != inputSize || time != inputTime || itemsInChunk != chunkSize || chunkCompression != compression) {
+            // Other input or parameters, start from scratch
+            return;
+        }
+
+        std::map<size_t, CheckpointChunk> loadedChunks;
+
+        while (std::getline(in, line)) {
+            std::istringstream sstr(line);
+            sstr >> tag;
+
+            if (tag == "chunk") {
+                CheckpointChunk chunk;
+                if (sstr >> chunk.index >> chunk.inputBegin >> chunk.inputEnd >> chunk.entries >> chunk.bytes >> chunk.checksum >> chunk.fileName) {
+                    loadedChunks[chunk.index] = chunk;
+                }
+            } else if (tag == "merged") {
+                sstr >> mergedBytes >> mergedFileName;
+            } else if (tag == "shard") {
+                size_t count = 0;
+                size_t index = 0;
+                ShardInfo shard;
+                std::string firstKey;
+                std::string lastKey;
+                if (sstr >> count >> index >> shard.entries >> shard.bytes >> firstKey >> lastKey >> shard.fileName) {
+                    shard.firstKey = keyValue(firstKey);
+                    shard.lastKey = keyValue(lastKey);
+                    shards[index] = shard;
+                    shardCount = count;
+                }
+            }
+        }
+
+        // Longest run of intact chunks covering input from the beginning
+        uint64_t offset = 0;
+        for (size_t index = 0; loadedChunks.count(index); ++index) {
+            const CheckpointChunk& chunk = loadedChunks[index];
+            if (chunk.inputBegin != offset || !intactChunk(chunk)) {
+                break;
+            }
+
+            reusedChunks.push_back(chunk);
+            chunks[index] = chunk;
+            offset = chunk.inputEnd;
+        }
+    }
+
+    // New manifest replaces old one by rename, so it is never seen half-written
+    void save() {
+        std::string tmpFileName = manifestFileName + ".tmp";
+
+        {
+            std::ofstream out(tmpFileName.c_str());
+            if (!out) {
+                throw Exception() << "Can't open checkpoint file" << tmpFileName;
+            }
+
+            out << "input " << inputSize << " " << inputTime << " " << chunkSize << " " << compression << "\n";
+
+            std::map<size_t, CheckpointChunk>::const_iterator chunkIt = chunks.begin();
+            for (; chunkIt != chunks.end(); ++chunkIt) {
+                const CheckpointChunk& chunk = chunkIt->second;
+                out << "chunk " << chunk.index << " " << chunk.inputBegin << " " << chunk.inputEnd << " " << chunk.entries
+                    << " " << chunk.bytes << " " << chunk.checksum << " " << chunk.fileName << "\n";
+            }
+
+            if (!mergedFileName.empty()) {
+                out << "merged " << mergedBytes << " " << mergedFileName << "\n";
+            }
+
+            std::map<size_t, ShardInfo>::const_iterator shardIt = shards.begin();
+            for (; shardIt != shards.end(); ++shardIt) {
+                const ShardInfo& shard = shardIt->second;
+                out << "shard " << shardCount << " " << shardIt->first << " " << shard.entries << " " << shard.bytes << " " << keyField(shard.firstKey)
+                    << " " << keyField(shard.lastKey) << " " << shard.fileName << "\n";
+            }
+
+            out.flush();
+            if (!out) {
+                throw Exception() << "Can't write checkpoint file" << tmpFileName;
+            }
+        }
+
+        if (rename(tmpFileName.c_str(), manifestFileName.c_str()) != 0) {
+            throw Exception() << "Can't rename" << tmpFileName << "to" << manifestFileName << strerror(errno);
+        }
+    }
+
+private:
+    const std::string manifestFileName;
+    uint64_t inputSize;
+    int64_t inputTime;
+    const size_t chunkSize;
+    const int compression;
+    std::vector<CheckpointChunk> reusedChunks;
+    std::map<size_t, CheckpointChunk> chunks;
+    std::string mergedFileName;
+    uint64_t mergedBytes;
+    size_t shardCount;
+    std::map<size_t, ShardInfo> shards;
+    mutable std::mutex mutex;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// FNV-1a over 64 bit words, tail bytes are hashed one by one. Data may be given by parts,
+// e.g. while it is written, the result is the same as of the whole data.
+class StreamChecksum {
+public:
+    StreamChecksum() :
+            hash(0xcbf29ce484222325ULL),
+            tailSize(0) {}
+
+    void update(const char* data, uint64_t size) {
+        if (tailSize) {
+            uint64_t count = std::min<uint64_t>(size, sizeof(uint64_t) - tailSize);
+            memcpy(tail + tailSize, data, count);
+            tailSize += count;
+            data += count;
+            size -= count;
+
+            if (tailSize < sizeof(uint64_t)) {
+                return;
+            }
+
+            addWord(tail);
+            tailSize = 0;
+        }
+
+        uint64_t words = size / sizeof(uint64_t);
+        for (uint64_t i = 0; i < words; ++i) {
+            addWord(data + i * sizeof(uint64_t));
+        }
+
+        tailSize = size - words * sizeof(uint64_t);
+        memcpy(tail, data + words * sizeof(uint64_t), tailSize);
+    }
+
+    uint64_t value() const {
+        uint64_t result = hash;
+        for (uint64_t i = 0; i < tailSize; ++i) {
+            result = (result ^ static_cast<unsigned char>(tail[i])) * PRIME;
+        }
+
+        return result;
+    }
+
+private:
+    static const uint64_t PRIME = 0x100000001b3ULL;
+
+    void addWord(const char* data) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * PRIME;
+    }
+
+    uint64_t hash;
+    char tail[sizeof(uint64_t)];
+    uint64_t tailSize;
+};
+
+inline uint64_t checksum(const char* data, uint64_t size) {
+    StreamChecksum result;
+    result.update(data, size);
+    return result.value();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdio>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Chunk directory may be a list of directories separated by ':', e.g. one per
+// device. Chunk files are striped over them round-robin, so concurrently
+// written and merged chunks use all devices.
+
+inline std::vector<std::string> chunkDirList(const std::string& chunkDir) {
+    std::vector<std::string> dirs;
+
+    size_t begin = 0;
+    while (true) {
+        size_t end = chunkDir.find(':', begin);
+        std::string dir = chunkDir.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        if (!dir.empty()) {
+            dirs.push_back(dir);
+        }
+
+        if (end == std::string::npos) {
+            break;
+        }
+
+        begin = end + 1;
+    }
+
+    if (dirs.empty()) {
+        dirs.push_back(".");
+    }
+
+    return dirs;
+}
+
+// Directory for files which aren't striped, e.g. checkpoint manifest
+inline std::string firstChunkDir(const std::string& chunkDir) {
+    return chunkDirList(chunkDir).front();
+}
+
+inline std::string stripedChunkFileName(const std::string& chunkDir, const std::string& prefix, size_t chunkCounter) {
+    std::vector<std::string> dirs = chunkDirList(chunkDir);
+
+    std::stringstream sstr;
+    sstr << dirs[chunkCounter % dirs.size()] << "/" << prefix << chunkCounter << ".dat";
+    return sstr.str();
+}
+
+inline void removeChunkFiles(const std::list<std::string>& chunkFiles) {
+    for (const std::string& fileName : chunkFiles) {
+        std::remove(fileName.c_str());
+    }
+}
@@ -1,11 +1,12 @@
 #pragma once
 
+#include <chunkdir.h>
 #include <filearchive.h>
 #include <noncopyable.h>
 
+#include <functional>
 #include <list>
 #include <memory>
-#include <sstream>
 #include <string>
 
 template <typename T>
@@ -14,8 +15,10 @@ public:
     typedef T EntryType;
 
     Chunker(const std::string& chnkDir, size_t countInChnk,
-        std::function<void(const char*)> chnkFilled = std::function<void(const char*)>()) :
+        std::function<void(const char*)> chnkFilled = std::function<void(const char*)>(),
+        const std::string& chnkPrefix = "chunk_") :
             chunkDir(chnkDir),
+            chunkPrefix(chnkPrefix),
             countInChunk(countInChnk),
             chunkDataCounter(0),
             chunkCounter(0),
@@ -55,13 +58,12 @@ public:
 
 private:
     std::string getChunkFileName() const {
-        std::stringstream sstr;
-        sstr << chunkDir << "/chunk_" << chunkCounter << ".dat";
-        return sstr.str();
+        return stripedChunkFileName(chunkDir, chunkPrefix, chunkCounter);
     }
 
 private:
     const std::string chunkDir;
+    const std::string chunkPrefix;
     const size_t countInChunk;
     size_t chunkDataCounter;
     size_t chunkCounter;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <exception.h>
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Splits command line to positional arguments and --name[=value] options
+class CommandLine {
+public:
+    CommandLine(int argc, char* argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+
+            if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+                size_t eqPos = arg.find('=');
+                if (eqPos == std::string::npos) {
+                    options[arg.substr(2)] = "";
+                } else {
+                    options[arg.substr(2, eqPos - 2)] = arg.substr(eqPos + 1);
+                }
+            } else {
+                args.push_back(arg);
+            }
+        }
+    }
+
+    size_t argCount() const {
+        return args.size();
+    }
+
+    const char* arg(size_t index) const {
+        return args.at(index).c_str();
+    }
+
+    bool hasOption(const std::string& name) const {
+        return options.find(name) != options.end();
+    }
+
+    std::string option(const std::string& name, const std::string& defaultValue = std::string()) const {
+        std::map<std::string, std::string>::const_iterator it = options.find(name);
+        return it == options.end() ? defaultValue : it->second;
+    }
+
+    template <typename T>
+    T option(const std::string& name, const T& defaultValue) const {
+        std::map<std::string, std::string>::const_iterator it = options.find(name);
+        if (it == options.end()) {
+            return defaultValue;
+        }
+
+        T value;
+        std::istringstream sstr(it->second);
+        if (!(sstr >> value)) {
+            throw Exception() << "Wrong value" << it->second << "of option" << name;
+        }
+
+        return value;
+    }
+
+    void checkOptions(const std::set<std::string>& knownOptions) const {
+        std::map<std::string, std::string>::const_iterator it = options.begin();
+        for (; it != options.end(); ++it) {
+            if (!knownOptions.count(it->first)) {
+                throw Exception() << "Unknown option" << it->first;
+            }
+        }
+    }
+
+private:
+    std::vector<std::string> args;
+    std::map<std::string, std::string> options;
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <checksum.h>
+#include <compression.h>
+#include <exception.h>
+#include <filearchive.h>
+#include <memarchive.h>
+#include <noncopyable.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// File consists of blocks: [raw size][stored size][data]. Block is stored
+// uncompressed if compression doesn't make it smaller.
+
+namespace _Impl {
+
+struct CompressedBlockHeader {
+    uint32_t rawSize;
+    uint32_t storedSize;
+};
+
+}
+
+class CompressedFileOutArchive : Noncopyable {
+public:
+    enum {
+        DEFAULT_BLOCK_SIZE = 1 << 16
+    };
+
+    explicit CompressedFileOutArchive(const std::string& fileName, size_t blckSize = DEFAULT_BLOCK_SIZE) :
+            out(fileName.c_str()),
+            blockSize(blckSize),
+            blockStartPos(0),
+            checksumEnabled(false) {
+        if (!out) {
+            throw Exception() << "Can't open file" << fileName << strerror(errno);
+        }
+
+        block.reserve(blockSize);
+    }
+
+    ~CompressedFileOutArchive() {
+        flushBlock();
+    }
+
+    template <typename T>
+    void write(const T& value, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        write(&value, 1);
+    }
+
+    template <typename T>
+    void write(const T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        const char* data = reinterpret_cast<const char*>(ptr);
+        size_t size = sizeof(T) * count;
+
+        while (size) {
+            size_t chunkSize = std::min(size, blockSize - block.size());
+            block.insert(block.end(), data, data + chunkSize);
+            data += chunkSize;
+            size -= chunkSize;
+
+            if (block.size() == blockSize) {
+                flushBlock();
+            }
+        }
+    }
+
+    uint64_t pos() const {
+        return blockStartPos + block.size();
+    }
+
+    void flush() {
+        flushBlock();
+        out.flush();
+    }
+
+    // Checksum of stored bytes written after this call, pending block is included after flush
+    void enableChecksum() {
+        checksumEnabled = true;
+    }
+
+    uint64_t checksum() const {
+        return writtenChecksum.value();
+    }
+
+private:
+    void flushBlock() {
+        if (block.empty()) {
+            return;
+        }
+
+        compressed.clear();
+        lzCompress(&block.front(), block.size(), compressed);
+
+        _Impl::CompressedBlockHeader header;
+        header.rawSize = block.size();
+
+        if (compressed.size() < block.size()) {
+            header.storedSize = compressed.size();
+            writeStored(reinterpret_cast<const char*>(&header), sizeof(header));
+            writeStored(&compressed.front(), compressed.size());
+        } else {
+            header.storedSize = block.size();
+            writeStored(reinterpret_cast<const char*>(&header), sizeof(header));
+            writeStored(&block.front(), block.size());
+        }
+
+        blockStartPos += block.size();
+        block.clear();
+    }
+
+    void writeStored(const char* data, size_t size) {
+        out.write(data, size);
+        if (checksumEnabled) {
+            writtenChecksum.update(data, size);
+        }
+    }
+
+private:
+    std::ofstream out;
+    const size_t blockSize;
+    uint64_t blockStartPos;
+    std::vector<char> block;
+    std::vector<char> compressed;
+    bool checksumEnabled;
+    StreamChecksum writtenChecksum;
+};
+
+class CompressedFileInArchive : Noncopyable {
+public:
+    explicit CompressedFileInArchive(const std::string& fName, uint64_t windowSize = 0, bool releaseRead = false) :
+            fileName(fName),
+            fileArchive(fName, windowSize, releaseRead),
+            blockStartPos(0) {}
+
+    template <typename T>
+    bool read(T& entry, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        return read(&entry, 1);
+    }
+
+    template <typename T>
+    bool read(T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        if (eof()) {
+            return false;
+        }
+
+        char* data = reinterpret_cast<char*>(ptr);
+        size_t size = sizeof(T) * count;
+
+        while (size) {
+            if (blockArchive.eof() && !nextBlock()) {
+                throw Exception() << "Can't read" << size << "bytes from" << fileName << "because it is out of bounds";
+            }
+
+            size_t chunkSize = std::min(size, blockArchive.remaining());
+            blockArchive.read(data, chunkSize);
+            data += chunkSize;
+            size -= chunkSize;
+        }
+
+        return true;
+    }
+
+    bool eof() const {
+        return blockArchive.eof() && fileArchive.eof();
+    }
+
+    uint64_t pos() const {
+        return blockStartPos + blockArchive.pos();
+    }
+
+    void skip(uint64_t bytes) {
+        while (bytes) {
+            if (blockArchive.eof()) {
+                _Impl::CompressedBlockHeader header;
+                if (!nextBlockHeader(header)) {
+                    throw Exception() << "Can't skip" << bytes << "bytes in" << fileName << "because it is out of bounds";
+                }
+
+                // Whole block is skipped without decompression
+                if (header.rawSize <= bytes) {
+                    fileArchive.skip(header.storedSize);
+                    blockStartPos += header.rawSize;
+                    bytes -= header.rawSize;
+                    continue;
+                }
+
+                loadBlock(header);
+            }
+
+            size_t chunkSize = std::min<uint64_t>(bytes, blockArchive.remaining());
+            blockArchive.skip(chunkSize);
+            bytes -= chunkSize;
+        }
+    }
+
+private:
+    bool nextBlock() {
+        _Impl::CompressedBlockHeader header;
+        if (!nextBlockHeader(header)) {
+            return false;
+        }
+
+        loadBlock(header);
+
+        return true;
+    }
+
+    bool nextBlockHeader(_Impl::CompressedBlockHeader& header) {
+        if (fileArchive.eof()) {
+            return false;
+        }
+
+        blockStartPos += blockArchive.pos();
+        blockArchive.setBuffer(0, 0);
+
+        return fileArchive.read(header);
+    }
+
+    void loadBlock(const _Impl::CompressedBlockHeader& header) {
+        // Stays valid until next block because file archive isn't touched before
+        const char* storedData = fileArchive.data(header.storedSize);
+
+        if (header.storedSize == header.rawSize) {
+            blockArchive.setBuffer(storedData, storedData + header.rawSize);
+        } else {
+            block.resize(header.rawSize);
+            lzDecompress(storedData, header.storedSize, &block.front(), block.size());
+            blockArchive.setBuffer(&block.front(), &block.front() + block.size());
+        }
+    }
+
+private:
+    std::string fileName;
+    FileInArchive fileArchive;
+    MemoryInArchive blockArchive;
+    uint64_t blockStartPos;
+    std::vector<char> block;
+};
+
+typedef CopyableOutArchive<CompressedFileOutArchive> CopyableCompressedFileOutArchive;
+typedef CopyableInArchive<CompressedFileInArchive> CopyableCompressedFileInArchive;
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <exception.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Byte oriented LZ77 block codec. Block is a sequence of
+// [token][literal length][literals][offset][match length] records, token holds
+// literal length in high and match length in low nibble, nibble value 15 means
+// length continues in following bytes. Last record has literals only.
+
+namespace _Impl {
+
+enum {
+    LZ_MIN_MATCH = 4,
+    LZ_HASH_BITS = 12,
+    LZ_MAX_OFFSET = 0xFFFF,
+    // Bytes at block end which are always stored as literals
+    LZ_LAST_LITERALS = 8
+};
+
+inline uint32_t lzRead32(const char* ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+inline uint32_t lzHash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+inline void lzWriteLength(std::vector<char>& out, size_t length) {
+    while (length >= 0xFF) {
+        out.push_back(static_cast<char>(0xFF));
+        length -= 0xFF;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline size_t lzReadLength(const unsigned char*& ptr, const unsigned char* end, size_t length) {
+    if (length != 0xF) {
+        return length;
+    }
+
+    unsigned char byte;
+    do {
+        if (ptr == end) {
+            throw Exception() << "Corrupted compressed block";
+        }
+
+        byte = *ptr++;
+        length += byte;
+    } while (byte == 0xFF);
+
+    return length;
+}
+
+inline void lzWriteSequence(std::vector<char>& out, const char* literals, size_t literalCount,
+        size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+
+    unsigned char token = (literalCount < 0xF ? literalCount : 0xF) << 4;
+    token |= matchCode < 0xF ? matchCode : 0xF;
+    out.push_back(static_cast<char>(token));
+
+    if (literalCount >= 0xF) {
+        lzWriteLength(out, literalCount - 0xF);
+    }
+
+    out.insert(out.end(), literals, literals + literalCount);
+
+    if (matchLength) {
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+
+        if (matchCode >= 0xF) {
+            lzWriteLength(out, matchCode - 0xF);
+        }
+    }
+}
+
+}
+
+// Appends compressed data to out
+inline void lzCompress(const char* data, size_t size, std::vector<char>& out) {
+    uint32_t table[1 << _Impl::LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    const size_t matchLimit = size > _Impl::LZ_LAST_LITERALS ? size - _Impl::LZ_LAST_LITERALS : 0;
+
+    while (pos + _Impl::LZ_MIN_MATCH <= matchLimit) {
+        uint32_t sequence = _Impl::lzRead32(data + pos);
+        uint32_t& slot = table[_Impl::lzHash(sequence)];
+        size_t candidate = slot;
+        slot = pos;
+
+        if (candidate == 0xFFFFFFFF || pos - candidate > _Impl::LZ_MAX_OFFSET ||
+                _Impl::lzRead32(data + candidate) != sequence) {
+            // Speed up on incompressible data
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        size_t matchLength = _Impl::LZ_MIN_MATCH;
+        while (pos + matchLength < matchLimit && data[candidate + matchLength] == data[pos + matchLength]) {
+            ++matchLength;
+        }
+
+        _Impl::lzWriteSequence(out, data + anchor, pos - anchor, pos - candidate, matchLength);
+
+        pos += matchLength;
+        anchor = pos;
+    }
+
+    _Impl::lzWriteSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+// Decompresses block to out buffer which must have exactly original size
+inline void lzDecompress(const char* data, size_t size, char* out, size_t outSize) {
+    const unsigned char* ptr = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = ptr + size;
+
+    char* outPtr = out;
+    char* outEnd = out + outSize;
+
+    while (ptr != end) {
+        unsigned char token = *ptr++;
+
+        size_t literalCount = _Impl::lzReadLength(ptr, end, token >> 4);
+        if (literalCount > static_cast<size_t>(end - ptr) || literalCount > static_cast<size_t>(outEnd - outPtr)) {
+            throw Exception() << "Corrupted compressed block";
+        }
+
+        memcpy(outPtr, ptr, literalCount);
+        outPtr += literalCount;
+        ptr += literalCount;
+
+        if (ptr == end) {
+            break;
+        }
+
+        if (end - ptr < 2) {
+            throw Exception() << "Corrupted compressed block";
+        }
+
+        size_t offset = ptr[0] | (ptr[1] << 8);
+        ptr += 2;
+
+        size_t matchLength = _Impl::lzReadLength(ptr, end, token & 0xF) + _Impl::LZ_MIN_MATCH;
+
+        if (!offset || offset > static_cast<size_t>(outPtr - out) || matchLength > static_cast<size_t>(outEnd - outPtr)) {
+            throw Exception() << "Corrupted compressed block";
+        }
+
+        // Source and destination can overlap
+        const char* matchPtr = outPtr - offset;
+        for (size_t i = 0; i < matchLength; ++i) {
+            outPtr[i] = matchPtr[i];
+        }
+        outPtr += matchLength;
+    }
+
+    if (outPtr != outEnd) {
+        throw Exception() << "Corrupted compressed block";
+    }
+}
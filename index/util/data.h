@@ -1,24 +1,46 @@
 #pragma once
 
+#include <arena.h>
+#include <keyprefix.h>
+#include <keytraits.h>
 #include <serializer.h>
 
 #include <cstdlib>
 #include <cstring>
 #include <vector>
 
-class Key : std::vector<unsigned char> {
+// Fixed array, so entries containing key need no allocation and can be bitwise serializable
+class __attribute__((packed)) Key {
 public:
     enum {
         SIZE = 10,
     };
 
-    Key() : std::vector<unsigned char>(SIZE, 0) {}  
+    typedef unsigned char value_type;
 
-    using std::vector<unsigned char>::front;
-    using std::vector<unsigned char>::operator=;
-    using std::vector<unsigned char>::operator[];
-    using std::vector<unsigned char>::size;
-    using std::vector<unsigned char>::value_type;
+    Key() {
+        memset(bytes, 0, SIZE);
+    }
+
+    unsigned char& front() {
+        return bytes[0];
+    }
+
+    const unsigned char& front() const {
+        return bytes[0];
+    }
+
+    unsigned char& operator[](size_t index) {
+        return bytes[index];
+    }
+
+    const unsigned char& operator[](size_t index) const {
+        return bytes[index];
+    }
+
+    size_t size() const {
+        return SIZE;
+    }
 
     bool operator < (const Key& other) const {
         return (memcmp(&front(), &other.front(), sizeof(unsigned char) * SIZE) < 0);
@@ -45,9 +67,13 @@ public:
     void deserialize(InArchive& in) {
         in.read(&front(), SIZE);
     }
+
+private:
+    unsigned char bytes[SIZE];
 };
 
-class DataHeader {
+// Packed, so header is read and written by one copy
+class __attribute__((packed)) DataHeader {
 public:
     enum {
         CANARY = 0xABCDEF
@@ -65,18 +91,15 @@ public:
     uint64_t        canary;
     uint64_t        dataSize;
 
+    // Key, canary and data size
     template <typename OutArchive>
     void serialize(OutArchive& out) const {
-        key.serialize(out);
-        out.write(canary);
-        out.write(dataSize);
+        out.write(reinterpret_cast<const char*>(this), sizeof(*this));
     }
 
     template <typename InArchive>
     void deserialize(InArchive& in) {
-        key.deserialize(in);
-        in.read(canary);
-        in.read(dataSize);
+        in.read(reinterpret_cast<char*>(this), sizeof(*this));
     }
 
     bool isValid() const {
@@ -84,13 +107,18 @@ public:
     }
 };
 
+static_assert(sizeof(DataHeader) == Key::SIZE + 2 * sizeof(uint64_t), "DataHeader must have no padding");
+
 class DataEntry {
 public:
     DataEntry() {}
 
+    // Payload is in arena of chunk while chunk is sorted (see ArenaPlacement)
+    typedef std::vector<char, ArenaAllocator<char> > Payload;
+
     DataEntry(const DataHeader& header_, const std::vector<char>& data_) :
             header(header_),
-            data(data_) {}
+            data(data_.begin(), data_.end()) {}
 
     template <typename OutArchive>
     void serialize(OutArchive& out) const {
@@ -110,6 +138,17 @@ public:
         }
     }
 
+    // Payload is read into memory of arena
+    template <typename InArchive>
+    void deserialize(InArchive& in, Arena& arena) {
+        header.deserialize(in);
+        data = Payload(ArenaAllocator<char>(&arena));
+        if (header.dataSize) {
+            data.resize(header.dataSize);
+            in.read(&data.front(), data.size());
+        }
+    }
+
     bool operator < (const DataEntry& other) const {
         return header.key < other.header.key;
     }
@@ -123,7 +162,7 @@ public:
     }
 
     DataHeader header;
-    std::vector<char> data;
+    Payload data;
 };
 
 template <>
@@ -131,12 +170,112 @@ struct IsClassSerializable<Key> {
     static const bool value = true;
 };
 
+template <>
+struct IsBitwiseSerializable<Key> {
+    static const bool value = true;
+};
+
 template <>
 struct IsClassSerializable<DataHeader> {
     static const bool value = true;
 };
 
+template <>
+struct IsBitwiseSerializable<DataHeader> {
+    static const bool value = true;
+};
+
 template <>
 struct IsClassSerializable<DataEntry> {
     static const bool value = true;
 };
+
+// Payload isn't read, entry keeps header only
+template <>
+struct HeaderScan<DataEntry> {
+    static const bool enabled = true;
+
+    template <typename InArchive>
+    static void read(DataEntry& entry, InArchive& in) {
+        entry.header.deserialize(in);
+        entry.data.clear();
+        in.skip(entry.header.dataSize);
+    }
+};
+
+template <>
+struct ArenaPlacement<DataEntry> {
+    static const bool enabled = true;
+
+    template <typename InArchive>
+    static void read(DataEntry& entry, InArchive& in, Arena& arena) {
+        entry.deserialize(in, arena);
+    }
+};
+
+template <>
+struct KeyPrefix<Key> {
+    static const bool enabled = true;
+
+    static uint64_t get(const Key& key) {
+        return bigEndianPrefix(&key.front(), Key::SIZE);
+    }
+};
+
+template <>
+struct KeyPrefix<DataEntry> {
+    static const bool enabled = true;
+
+    static uint64_t get(const DataEntry& entry) {
+        return KeyPrefix<Key>::get(entry.header.key);
+    }
+};
+
+template <>
+struct SparseIndexKey<DataEntry> {
+    typedef Key KeyType;
+
+    static const Key& get(const DataEntry& entry) {
+        return entry.header.key;
+    }
+};
+
+template <>
+struct KeyString<Key> {
+    static std::string get(const Key& key) {
+        return hexString(&key.front(), Key::SIZE);
+    }
+};
+
+template <>
+struct KeyString<DataEntry> {
+    static std::string get(const DataEntry& entry) {
+        return KeyString<Key>::get(entry.header.key);
+    }
+};
+
+template <>
+struct RecordBoundary<DataEntry> {
+    static const bool splittable = true;
+
+    enum {
+        HEADER_SIZE = Key::SIZE + 2 * sizeof(uint64_t)
+    };
+
+    static uint64_t recordSize(const char* ptr, const char* end) {
+        if (end - ptr < HEADER_SIZE) {
+            return 0;
+        }
+
+        uint64_t canary;
+        uint64_t dataSize;
+        memcpy(&canary, ptr + Key::SIZE, sizeof(canary));
+        memcpy(&dataSize, ptr + Key::SIZE + sizeof(canary), sizeof(dataSize));
+
+        if (canary != DataHeader::CANARY || dataSize > static_cast<uint64_t>(end - ptr - HEADER_SIZE)) {
+            return 0;
+        }
+
+        return HEADER_SIZE + dataSize;
+    }
+};
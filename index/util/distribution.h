@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chunkdir.h>
+#include <keyprefix.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Distribution sort: input is partitioned by splitters into bucket files with disjoint
+// ordered key ranges, then every bucket is sorted in memory and buckets are written
+// one after another, so no merge is needed.
+
+inline std::string bucketFileName(const std::string& chunkDir, size_t bucket) {
+    return stripedChunkFileName(chunkDir, "bucket_", bucket);
+}
+
+// Bucket of entry is the number of splitters not greater than entry. Key prefixes of
+// splitters decide most lookups, entries are compared only if prefixes are equal.
+template <typename T>
+class BucketSplitters {
+public:
+    // bucketCount - 1 splitters split sorted sample to equal parts
+    BucketSplitters(const std::vector<T>& sortedSample, size_t bucketCount) {
+        for (size_t bucket = 1; bucket < bucketCount && !sortedSample.empty(); ++bucket) {
+            splitters.push_back(sortedSample[sortedSample.size() * bucket / bucketCount]);
+            prefixes.push_back(KeyPrefix<T>::get(splitters.back()));
+        }
+    }
+
+    size_t bucketCount() const {
+        return splitters.size() + 1;
+    }
+
+    size_t bucket(const T& entry) const {
+        size_t begin = 0;
+        size_t end = splitters.size();
+
+        if (KeyPrefix<T>::enabled) {
+            const uint64_t prefix = KeyPrefix<T>::get(entry);
+            begin = std::lower_bound(prefixes.begin(), prefixes.end(), prefix) - prefixes.begin();
+            end = std::upper_bound(prefixes.begin() + begin, prefixes.end(), prefix) - prefixes.begin();
+        }
+
+        return std::upper_bound(splitters.begin() + begin, splitters.begin() + end, entry) - splitters.begin();
+    }
+
+private:
+    std::vector<T> splitters;
+    std::vector<uint64_t> prefixes;
+};
@@ -1,28 +1,61 @@
 #pragma once
 
+#include <checksum.h>
 #include <exception.h>
 #include <memarchive.h>
 #include <mmapper.h>
 #include <noncopyable.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+inline uint64_t fileSize(const std::string& fileName) {
+    struct stat fileStat;
+    if (stat(fileName.c_str(), &fileStat) != 0) {
+        throw Exception() << "Can't stat file" << fileName << strerror(errno);
+    }
+
+    return fileStat.st_size;
+}
 
 class FileOutArchive : Noncopyable {
 public:
     explicit FileOutArchive(const std::string& fileName) :
-            out(fileName.c_str()) {}
+            out(fileName.c_str()),
+            checksumEnabled(false) {
+        if (!out) {
+            throw Exception() << "Can't open file" << fileName << strerror(errno);
+        }
+    }
 
     template <typename T>
     void write(const T& value, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
-        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        writeBytes(reinterpret_cast<const char*>(&value), sizeof(value));
     }
 
     template <typename T>
     void write(const T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
-        out.write(reinterpret_cast<const char*>(ptr), sizeof(T) * count);
+        writeBytes(reinterpret_cast<const char*>(ptr), sizeof(T) * count);
+    }
+
+    // Checksum of bytes written after this call, it is the one of the whole file if called first
+    void enableChecksum() {
+        checksumEnabled = true;
+    }
+
+    uint64_t checksum() const {
+        return writtenChecksum.value();
     }
 
     uint64_t pos() {
@@ -34,13 +67,24 @@ public:
     }
 
 private:
+    void writeBytes(const char* data, size_t size) {
+        out.write(data, size);
+        if (checksumEnabled) {
+            writtenChecksum.update(data, size);
+        }
+    }
+
     std::ofstream out;
+    bool checksumEnabled;
+    StreamChecksum writtenChecksum;
 };
 
-class CopyableFileOutArchive {
+// Shares archive between copies, e.g. to keep it in std::list or pass to thread
+template <typename Archive>
+class CopyableOutArchive {
 public:
-    explicit CopyableFileOutArchive(const std::string& fileName) :
-            impl(new FileOutArchive(fileName)) {}
+    explicit CopyableOutArchive(const std::string& fileName) :
+            impl(new Archive(fileName)) {}
 
     template <typename T>
     void write(const T& value) {
@@ -61,18 +105,68 @@ public:
     }
 
 private:
-    std::shared_ptr<FileOutArchive> impl;
+    std::shared_ptr<Archive> impl;
+};
+
+typedef CopyableOutArchive<FileOutArchive> CopyableFileOutArchive;
+
+// Frees disk blocks of file prefix which was read, file size stays the same.
+// Errors are ignored because not every file system supports it.
+class HolePuncher : Noncopyable {
+public:
+    explicit HolePuncher(const std::string& fileName) :
+            fileFd(::open(fileName.c_str(), O_WRONLY)),
+            punchedOffset(0) {}
+
+    ~HolePuncher() {
+        if (fileFd != -1) {
+            ::close(fileFd);
+        }
+    }
+
+    // Frees whole pages before offset
+    void punchTo(uint64_t offset) {
+        uint64_t end = offset - offset % ReadOnlyMemMapper::pageSize();
+        if (fileFd != -1 && end > punchedOffset) {
+            ::fallocate(fileFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, punchedOffset, end - punchedOffset);
+            punchedOffset = end;
+        }
+    }
+
+private:
+    int fileFd;
+    uint64_t punchedOffset;
 };
 
+// Maps whole file or, if window size is set, sliding window of it. Window
+// mode keeps resident memory and page cache bounded for huge files. With
+// releaseRead window mode also punches holes behind the window, for files
+// which are read once and deleted.
 class FileInArchive : Noncopyable {
 public:
-    explicit FileInArchive(const std::string& fName) :
+    explicit FileInArchive(const std::string& fName, uint64_t windowSz = 0, bool releaseRead = false) :
             mMapper(fName),
-            fileName(fName) {
-        mMapper.map();
-        const char* beginPtr = mMapper.getBeginPtr();
-        const char* endPtr = mMapper.getEndPtr();
-        memArchive.setBuffer(beginPtr, endPtr);
+            fileName(fName),
+            windowSize(windowSz),
+            windowOffset(0),
+            fileSize(0) {
+        if (windowSize && releaseRead) {
+            holePuncher.reset(new HolePuncher(fileName));
+        }
+
+        if (windowSize) {
+            uint64_t pageSize = ReadOnlyMemMapper::pageSize();
+            windowSize = (windowSize + pageSize - 1) / pageSize * pageSize;
+            fileSize = mMapper.getFileSize();
+            mapWindow(0, 0);
+        } else {
+            mMapper.map();
+            mMapper.advise(MADV_SEQUENTIAL);
+            const char* beginPtr = mMapper.getBeginPtr();
+            const char* endPtr = mMapper.getEndPtr();
+            memArchive.setBuffer(beginPtr, endPtr);
+            fileSize = endPtr - beginPtr;
+        }
     }
 
     template <typename T>
@@ -83,31 +177,100 @@ public:
     template <typename T>
     bool read(T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
         size_t bytesToRead = count * sizeof(T);
+
+        if (bytesToRead > memArchive.remaining() && windowSize) {
+            if (eof()) {
+                return false;
+            }
+
+            ensureWindow(bytesToRead);
+        }
+
         return memArchive.read(reinterpret_cast<char*>(ptr), bytesToRead);
     }
 
+    // Returns pointer to next size bytes of file and skips them. Pointer is
+    // valid until next call of any reading method.
+    const char* data(size_t size) {
+        if (size > memArchive.remaining() && windowSize) {
+            ensureWindow(size);
+        }
+
+        const char* ptr = mMapper.getBeginPtr() + memArchive.pos();
+        memArchive.skip(size);
+
+        return ptr;
+    }
+
     bool eof() const {
-        return memArchive.eof();
+        return pos() == fileSize;
     }
 
     uint64_t pos() const {
-        return memArchive.pos();
+        return windowOffset + memArchive.pos();
     }
 
     void skip(uint64_t bytes) {
-        return memArchive.skip(bytes);
+        if (bytes <= memArchive.remaining() || !windowSize) {
+            return memArchive.skip(bytes);
+        }
+
+        if (pos() + bytes > fileSize) {
+            throw Exception() << "Can't skip" << bytes << "bytes in" << fileName << "because it is out of bounds";
+        }
+
+        mapWindow(pos() + bytes, 0);
+    }
+
+private:
+    void ensureWindow(uint64_t size) {
+        if (pos() + size > fileSize) {
+            throw Exception() << "Can't read" << size << "bytes from" << fileName << "because it is out of bounds";
+        }
+
+        mapWindow(pos(), size);
+    }
+
+    void mapWindow(uint64_t offset, uint64_t minSize) {
+        // Pages behind new offset won't be read again
+        if (offset > windowOffset) {
+            mMapper.advise(MADV_DONTNEED);
+            mMapper.adviseFile(windowOffset, offset - windowOffset, POSIX_FADV_DONTNEED);
+        }
+
+        mMapper.mapWindow(offset, std::max(windowSize, minSize));
+        mMapper.advise(MADV_SEQUENTIAL);
+        mMapper.advise(MADV_WILLNEED);
+
+        const char* beginPtr = mMapper.getBeginPtr();
+        const char* endPtr = mMapper.getEndPtr();
+        memArchive.setBuffer(beginPtr, endPtr);
+        windowOffset = offset;
+
+        if (holePuncher) {
+            holePuncher->punchTo(offset);
+        }
+
+        // Read next window ahead while current one is processed
+        mMapper.adviseFile(offset + (endPtr - beginPtr), windowSize, POSIX_FADV_WILLNEED);
     }
 
 private:
     MemoryInArchive memArchive;
     ReadOnlyMemMapper mMapper;
     std::string fileName;
+    uint64_t windowSize;
+    uint64_t windowOffset;
+    uint64_t fileSize;
+    std::unique_ptr<HolePuncher> holePuncher;
 };
 
-class CopyableFileInArchive {
+template <typename Archive>
+class CopyableInArchive {
 public:
-    explicit CopyableFileInArchive(const std::string& fName) :
-            impl(new FileInArchive(fName)) {}
+    template <typename... Args>
+    explicit CopyableInArchive(const std::string& fName, Args&&... args) :
+            impl(new Archive(fName, std::forward<Args>(args)...)) {}
 
     template <typename T>
     bool read(T& entry) {
@@ -132,5 +295,7 @@ public:
     }
 
 private:
-    std::shared_ptr<FileInArchive> impl;
+    std::shared_ptr<Archive> impl;
 };
+
+typedef CopyableInArchive<FileInArchive> CopyableFileInArchive;
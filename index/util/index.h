@@ -2,14 +2,22 @@
 
 #include <serializer.h>
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
 
+#include <bufferpool.h>
+#include <chunkdir.h>
 #include <data.h>
 #include <exception.h>
 #include <sorter.h>
 
-struct IndexEntry {
+// Packed, layout of entry is its serialized layout
+struct __attribute__((packed)) IndexEntry {
     IndexEntry() :
             filePos(0),
             canary(DataHeader::CANARY) {}
@@ -23,20 +31,17 @@ struct IndexEntry {
         return key < other.key;
     }
 
+    // Key, file position and canary
     template <typename OutArchive>
     void serialize(OutArchive& out) const {
-        key.serialize(out);
-        out.write(filePos);
-        out.write(canary);
+        out.write(reinterpret_cast<const char*>(this), sizeof(*this));
     }
 
     template <typename InArchive>
     void deserialize(InArchive& in) {
-        key.deserialize(in);
-        in.read(filePos);
-        in.read(canary);
+        in.read(reinterpret_cast<char*>(this), sizeof(*this));
     }
- 
+
     bool isValid() const {
         return canary == DataHeader::CANARY;
     }
@@ -46,21 +51,307 @@ struct IndexEntry {
     uint64_t canary;
 };
 
+static_assert(sizeof(IndexEntry) == Key::SIZE + 2 * sizeof(uint64_t), "IndexEntry must have no padding");
+
 template <>
 struct IsClassSerializable<IndexEntry> {
     static const bool value = true;
 };
 
-template <typename DataEntry, typename IndexEntry, typename CreateKeyFunc>
-void createIndex(const char* dataFileName, const char* chunkDir, const char* outputFileName,
-        size_t itemsInChunk, size_t threadCount, CreateKeyFunc createKeyFunc) {
+template <>
+struct IsBitwiseSerializable<IndexEntry> {
+    static const bool value = true;
+};
+
+template <>
+struct KeyString<IndexEntry> {
+    static std::string get(const IndexEntry& entry) {
+        return KeyString<Key>::get(entry.key);
+    }
+};
+
+template <>
+struct KeyPrefix<IndexEntry> {
+    static const bool enabled = true;
+
+    static uint64_t get(const IndexEntry& entry) {
+        return KeyPrefix<Key>::get(entry.key);
+    }
+};
+
+// Index built by createIndexes: entry type, key function and output file
+template <typename IndexEntryType, typename CreateKeyFunc>
+struct IndexSpec {
+    typedef IndexEntryType EntryType;
+
+    IndexSpec(const std::string& outFileName, CreateKeyFunc keyFunc) :
+            outputFileName(outFileName),
+            createKeyFunc(keyFunc) {}
+
+    std::string outputFileName;
+    CreateKeyFunc createKeyFunc;
+};
+
+template <typename IndexEntryType, typename CreateKeyFunc>
+IndexSpec<IndexEntryType, CreateKeyFunc> indexSpec(const std::string& outputFileName, CreateKeyFunc createKeyFunc) {
+    return IndexSpec<IndexEntryType, CreateKeyFunc>(outputFileName, createKeyFunc);
+}
+
+namespace _Impl {
+
+// Sorts chunks of index entries gathered in memory in task group, so every chunk
+// is written once
+class IndexChunkSorter : Noncopyable {
+public:
+    IndexChunkSorter(TaskGroup& group, ChunkCompression chunkCompression, MetricsRecorder& metricsRecorder,
+            SyncEventCallback<DefaultEventCallback>& callback) :
+            sortGroup(group),
+            compression(chunkCompression),
+            recorder(metricsRecorder),
+            syncCallback(callback),
+            chunkCounter(0) {}
+
+    template <typename EntryType>
+    void sortChunk(typename ChunkBufferPool<EntryType>::BufferPtr&& buffer, ChunkBufferPool<EntryType>& bufferPool,
+            const std::string& fileName, RunSampler<EntryType>* sampler) {
+        size_t chunkIndex = chunkCounter++;
+
+        MetricsRecorder& recorder = this->recorder;
+        SyncEventCallback<DefaultEventCallback>& syncCallback = this->syncCallback;
+
+        std::function<void(const ChunkMetrics&)> chunkDone = [chunkIndex, &recorder, &syncCallback](const ChunkMetrics& chunk) {
+            recorder.addChunk(chunkIndex, chunk);
+            syncCallback(ChunkSorted, chunkIndex);
+        };
+
+        if (compression == LzChunkCompression) {
+            sortGroup.run(SortFunctor<EntryType, DefaultSortFunction, CompressedFileOutArchive>(std::move(buffer), bufferPool,
+                    DefaultSortFunction(), fileName, chunkDone, sampler));
+        } else {
+            sortGroup.run(SortFunctor<EntryType, DefaultSortFunction>(std::move(buffer), bufferPool, DefaultSortFunction(),
+                    fileName, chunkDone, sampler));
+        }
+    }
+
+    // Waits tasks without rethrowing their exceptions
+    void waitNoThrow() {
+        try {
+            sortGroup.wait();
+        } catch (...) {
+        }
+    }
+
+private:
+    TaskGroup& sortGroup;
+    const ChunkCompression compression;
+    MetricsRecorder& recorder;
+    SyncEventCallback<DefaultEventCallback>& syncCallback;
+    size_t chunkCounter;
+};
+
+template <typename DataEntry, typename Spec>
+class IndexBuilder : Noncopyable {
+public:
+    typedef typename Spec::EntryType IndexEntry;
+
+    IndexBuilder(const Spec& indexSpec, const char* chunkDirectory, size_t itemsInChunk, size_t index, IndexChunkSorter& sorter,
+            bool sharded, size_t maxFreeBuffers) :
+            spec(indexSpec),
+            chunkDir(chunkDirectory),
+            chunkPrefix(getChunkPrefix(index)),
+            countInChunk(std::max<size_t>(itemsInChunk, 1)),
+            chunkSorter(sorter),
+            sampler(sharded ? new RunSampler<IndexEntry>() : 0),
+            bufferPool(maxFreeBuffers, false, false),
+            buffer(bufferPool.acquire()) {}
+
+    ~IndexBuilder() {
+        // Sort tasks return buffers to pool, it must outlive them if building is interrupted
+        chunkSorter.waitNoThrow();
+    }
+
+    void add(const DataEntry& entry, uint64_t filePos) {
+        buffer->entries.push_back(spec.createKeyFunc(entry, filePos));
+
+        if (buffer->entries.size() == countInChunk) {
+            sortChunk();
+        }
+    }
+
+    // Empty input gives one empty chunk
+    void finish() {
+        if (!buffer->entries.empty() || chunkFiles.empty()) {
+            sortChunk();
+        }
+    }
+
+    void merge(ThreadPool& threadPool, const SortOptions& options, MetricsRecorder& recorder) {
+        if (sampler) {
+            mergeChunkFilesToShards<IndexEntry>(chunkFiles, *sampler, spec.outputFileName.c_str(), threadPool, options, recorder);
+        } else {
+            mergeChunkFiles<IndexEntry>(chunkFiles, spec.outputFileName.c_str(), options, recorder);
+        }
+    }
+
+private:
+    static std::string getChunkPrefix(size_t index) {
+        std::stringstream sstr;
+        sstr << "index_" << index << "_chunk_";
+        return sstr.str();
+    }
+
+    void sortChunk() {
+        std::string chunkFileName = stripedChunkFileName(chunkDir, chunkPrefix, chunkFiles.size());
+        chunkFiles.push_back(chunkFileName);
+
+        chunkSorter.sortChunk<IndexEntry>(std::move(buffer), bufferPool, chunkFileName, sampler.get());
+        buffer = bufferPool.acquire();
+    }
+
+private:
+    const Spec& spec;
+    const std::string chunkDir;
+    const std::string chunkPrefix;
+    const size_t countInChunk;
+    IndexChunkSorter& chunkSorter;
+    std::unique_ptr< RunSampler<IndexEntry> > sampler;
+    ChunkBufferPool<IndexEntry> bufferPool;
+    typename ChunkBufferPool<IndexEntry>::BufferPtr buffer;
     std::list<std::string> chunkFiles;
+};
+
+template <typename DataEntry, typename... Specs>
+class IndexBuilders;
+
+template <typename DataEntry>
+class IndexBuilders<DataEntry> {
+public:
+    IndexBuilders(const char*, size_t, size_t, IndexChunkSorter&, bool, size_t) {}
+
+    void add(const DataEntry&, uint64_t) {}
+    void finish() {}
+    void merge(TaskGroup&, ThreadPool&, const SortOptions&, MetricsRecorder&) {}
+};
+
+template <typename DataEntry, typename Spec, typename... Specs>
+class IndexBuilders<DataEntry, Spec, Specs...> : Noncopyable {
+public:
+    IndexBuilders(const char* chunkDir, size_t itemsInChunk, size_t index, IndexChunkSorter& sorter, bool sharded,
+            size_t maxFreeBuffers, const Spec& spec, const Specs&... specs) :
+            head(spec, chunkDir, itemsInChunk, index, sorter, sharded, maxFreeBuffers),
+            tail(chunkDir, itemsInChunk, index + 1, sorter, sharded, maxFreeBuffers, specs...) {}
+
+    void add(const DataEntry& entry, uint64_t filePos) {
+        head.add(entry, filePos);
+        tail.add(entry, filePos);
+    }
+
+    void finish() {
+        head.finish();
+        tail.finish();
+    }
+
+    void merge(TaskGroup& mergeGroup, ThreadPool& threadPool, const SortOptions& options, MetricsRecorder& recorder) {
+        IndexBuilder<DataEntry, Spec>& builder = head;
+        mergeGroup.run([&builder, &threadPool, &options, &recorder]() {
+            builder.merge(threadPool, options, recorder);
+        });
+
+        tail.merge(mergeGroup, threadPool, options, recorder);
+    }
+
+private:
+    IndexBuilder<DataEntry, Spec> head;
+    IndexBuilders<DataEntry, Specs...> tail;
+};
+
+}
+
+// Builds several indexes with one scan of data file. Chunks of all indexes are
+// sorted and then merged concurrently by pool threads. If options.shardCount is
+// more than one every index is written as shards (see mergeChunksToShards).
+template <typename DataEntry, typename... IndexSpecs>
+void createIndexes(const char* dataFileName, const char* chunkDir, size_t itemsInChunk, ThreadPool& threadPool,
+        const SortOptions& options, const IndexSpecs&... indexSpecs) {
+    _Impl::MetricsRecorder recorder(options.metrics);
+    _Impl::PhaseTimer createPhaseTimer(recorder, &SortMetrics::createChunks);
+
+    _Impl::DefaultEventCallback eventCallback;
+    _Impl::SyncEventCallback<_Impl::DefaultEventCallback> syncCallback(eventCallback);
+
+    TaskGroup sortGroup(threadPool);
+    _Impl::IndexChunkSorter chunkSorter(sortGroup, options.chunkCompression, recorder, syncCallback);
+
+    // Index entries are gathered in memory, sorted and written once per chunk
+    _Impl::IndexBuilders<DataEntry, IndexSpecs...> builders(chunkDir, itemsInChunk, 0, chunkSorter,
+            options.shardCount > 1, threadPool.size() + 1, indexSpecs...);
+
+    _Impl::Stopwatch readStopwatch;
 
-    createAndSortChunks<DataEntry, Chunker<IndexEntry>>(dataFileName, chunkDir, chunkFiles, itemsInChunk, threadCount,
-            [createKeyFunc](const DataEntry& entry, Chunker<IndexEntry>& chunker, FileInArchive& inArchive) {
-                chunker.add(createKeyFunc(entry, inArchive.pos()));
-            }
-    );
-    mergeChunks<IndexEntry>(chunkFiles, outputFileName);
+    FileInArchive inArchive(dataFileName, options.mmapWindowSize);
+
+    const bool headerOnly = options.headerOnlyScan && HeaderScan<DataEntry>::enabled;
+
+    uint64_t recordsRead = 0;
+    DataEntry data;
+    while (!inArchive.eof()) {
+        if (headerOnly) {
+            HeaderScan<DataEntry>::read(data, inArchive);
+        } else {
+            deserialize(data, inArchive);
+        }
+
+        if (!isValid(data)) {
+            throw Exception() << "Read data is not valid";
+        }
+
+        builders.add(data, inArchive.pos());
+        ++recordsRead;
+    }
+
+    builders.finish();
+
+    recorder.addIoWait(readStopwatch.waitTime());
+
+    _Impl::Stopwatch waitStopwatch;
+    sortGroup.wait();
+    recorder.addQueueWait(waitStopwatch.wallTime());
+
+    recorder.update([&inArchive, recordsRead](SortMetrics& m) {
+        m.recordsRead += recordsRead;
+        m.bytesRead += inArchive.pos();
+    });
+
+    createPhaseTimer.stop();
+
+    _Impl::PhaseTimer mergePhaseTimer(recorder, &SortMetrics::mergeChunks);
+
+    TaskGroup mergeGroup(threadPool);
+    builders.merge(mergeGroup, threadPool, options, recorder);
+    mergeGroup.wait();
+
+    mergePhaseTimer.stop();
+}
+
+template <typename DataEntry, typename... IndexSpecs>
+void createIndexes(const char* dataFileName, const char* chunkDir, size_t itemsInChunk, size_t threadCount,
+        const SortOptions& options, const IndexSpecs&... indexSpecs) {
+    ThreadPool threadPool(threadCount);
+
+    createIndexes<DataEntry>(dataFileName, chunkDir, itemsInChunk, threadPool, options, indexSpecs...);
+}
+
+template <typename DataEntry, typename IndexEntry, typename CreateKeyFunc>
+void createIndex(const char* dataFileName, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, ThreadPool& threadPool, CreateKeyFunc createKeyFunc, const SortOptions& options = SortOptions()) {
+    createIndexes<DataEntry>(dataFileName, chunkDir, itemsInChunk, threadPool, options,
+            indexSpec<IndexEntry>(outputFileName, createKeyFunc));
 }
 
+template <typename DataEntry, typename IndexEntry, typename CreateKeyFunc>
+void createIndex(const char* dataFileName, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, size_t threadCount, CreateKeyFunc createKeyFunc, const SortOptions& options = SortOptions()) {
+    ThreadPool threadPool(threadCount);
+
+    createIndex<DataEntry, IndexEntry>(dataFileName, chunkDir, outputFileName, itemsInChunk, threadPool, createKeyFunc, options);
+}
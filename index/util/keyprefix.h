@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// Normalized key prefix is an integer whose order agrees with entry order:
+// a < b means prefix(a) <= prefix(b). Comparison of different prefixes gives
+// the result, full comparison is needed only for equal prefixes.
+template <typename T>
+struct KeyPrefix {
+    static const bool enabled = false;
+
+    static uint64_t get(const T&) {
+        return 0;
+    }
+};
+
+// First 8 bytes as big-endian number, shorter data is padded with zeros
+inline uint64_t bigEndianPrefix(const unsigned char* data, size_t size) {
+    uint64_t prefix = 0;
+
+    if (size >= sizeof(prefix)) {
+        memcpy(&prefix, data, sizeof(prefix));
+        return __builtin_bswap64(prefix);
+    }
+
+    for (size_t i = 0; i < sizeof(prefix); ++i) {
+        prefix = (prefix << 8) | (i < size ? data[i] : 0);
+    }
+
+    return prefix;
+}
+
+namespace _Impl {
+
+struct PrefixedIndex {
+    uint64_t prefix;
+    size_t index;
+};
+
+// Sorts (prefix, index) pairs instead of entries, then moves entries to their
+// places following permutation cycles
+template <typename RandomAccessIterator>
+void sortByKeyPrefix(RandomAccessIterator begin, RandomAccessIterator end) {
+    typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+    const size_t size = end - begin;
+
+    std::vector<PrefixedIndex> order(size);
+    for (size_t i = 0; i < size; ++i) {
+        order[i].prefix = KeyPrefix<T>::get(begin[i]);
+        order[i].index = i;
+    }
+
+    std::sort(order.begin(), order.end(), [begin](const PrefixedIndex& a, const PrefixedIndex& b) {
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
+        }
+
+        return begin[a.index] < begin[b.index];
+    });
+
+    for (size_t i = 0; i < size; ++i) {
+        if (order[i].index == i) {
+            continue;
+        }
+
+        T value = std::move(begin[i]);
+
+        size_t current = i;
+        while (order[current].index != i) {
+            size_t next = order[current].index;
+            begin[current] = std::move(begin[next]);
+            order[current].index = current;
+            current = next;
+        }
+
+        begin[current] = std::move(value);
+        order[current].index = current;
+    }
+}
+
+}
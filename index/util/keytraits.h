@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Key of entry as printable string, e.g. for shard manifests. Empty if not specialized.
+template <typename T>
+struct KeyString {
+    static std::string get(const T&) {
+        return std::string();
+    }
+};
+
+// Part of entry kept in sparse index of sorted file (see sparseindex.h), entries are
+// kept whole if not specialized. KeyType must be serializable and comparable.
+template <typename T>
+struct SparseIndexKey {
+    typedef T KeyType;
+
+    static const KeyType& get(const T& entry) {
+        return entry;
+    }
+};
+
+inline std::string hexString(const unsigned char* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+
+    std::string result;
+    result.reserve(size * 2);
+    for (size_t i = 0; i < size; ++i) {
+        result += digits[data[i] >> 4];
+        result += digits[data[i] & 0xf];
+    }
+
+    return result;
+}
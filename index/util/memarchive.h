@@ -1,5 +1,7 @@
 #pragma once
 
+#include <exception.h>
+
 #include <cassert>
 #include <cstring>
 #include <type_traits>
@@ -93,6 +95,10 @@ public:
         return currentPtr - bufferBegin;
     }
 
+    size_t remaining() const {
+        return bufferEnd - currentPtr;
+    }
+
     void skip(size_t bytes) {
         if (currentPtr + bytes > bufferEnd) {
             throw Exception() << "Can't skip" << bytes << "bytes because it is out of bounds";
@@ -1,30 +1,93 @@
 #pragma once
 
+#include <keyprefix.h>
+
 #include <fstream>
 #include <list>
 #include <queue>
+#include <utility>
 #include <vector>
 
+// Reads next item of run, returns false if run is ended. Run sources which
+// aren't archives overload it.
+template <typename ItemType, typename InArchive>
+bool readMergeItem(ItemType& item, InArchive& inArchive) {
+    //Save archive eof state because read operation can change it
+    bool eof = inArchive.eof();
+    deserialize(item, inArchive);
+    return !eof;
+}
+
+// Run of merge which is either archive or sorted items still in memory, so runs which
+// weren't written are merged together with files. Items are moved out of memory run.
+// Archive and items must outlive the run.
+template <typename ItemType, typename InArchive>
+class MergeRun {
+public:
+    explicit MergeRun(InArchive& inArchive) :
+            archive(&inArchive),
+            items(0),
+            pos(0) {}
+
+    explicit MergeRun(std::vector<ItemType>& runItems) :
+            archive(0),
+            items(&runItems),
+            pos(0) {}
+
+    bool read(ItemType& item) {
+        if (!items) {
+            return readMergeItem(item, *archive);
+        }
+
+        if (pos == items->size()) {
+            return false;
+        }
+
+        item = std::move((*items)[pos++]);
+        return true;
+    }
+
+private:
+    InArchive* archive;
+    std::vector<ItemType>* items;
+    size_t pos;
+};
+
+template <typename ItemType, typename InArchive>
+bool readMergeItem(ItemType& item, MergeRun<ItemType, InArchive>& run) {
+    return run.read(item);
+}
+
 template <typename ItemType, typename InArchive>
 class Merger {
     struct ItemHolder {
         ItemType* item;
         InArchive *inArchive;
+        // Key prefix of item, decides most comparisons without touching item
+        uint64_t prefix;
 
         ItemHolder(ItemType* itemPtr, InArchive *archive) :
                 item(itemPtr),
-                inArchive(archive) {}
+                inArchive(archive),
+                prefix(0) {}
 
         bool operator < (const ItemHolder& other) const {
             // Make min heap
-            return !(*item < *other.item);
+            return !itemLess(other);
+        }
+
+        bool itemLess(const ItemHolder& other) const {
+            if (KeyPrefix<ItemType>::enabled && prefix != other.prefix) {
+                return prefix < other.prefix;
+            }
+
+            return *item < *other.item;
         }
 
         bool readNextItem() {
-            //Save archive eof state because read operation can change it
-            bool eof = inArchive->eof();
-            deserialize(*item, *inArchive);
-            return !eof;
+            bool read = readMergeItem(*item, *inArchive);
+            prefix = KeyPrefix<ItemType>::get(*item);
+            return read;
         }
     };
 
@@ -60,7 +123,7 @@ public:
             const bool queueEmpty = priorityQueue.empty();
             const ItemHolder& topHolder = priorityQueue.top();
             bool holderRead = holder.readNextItem();
-            while (!queueEmpty && holderRead && *holder.item < *topHolder.item) {
+            while (!queueEmpty && holderRead && holder.itemLess(topHolder)) {
                 process(*holder.item);
                 holderRead = holder.readNextItem();
             }
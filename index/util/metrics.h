@@ -0,0 +1,254 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+struct PhaseMetrics {
+    PhaseMetrics() :
+            wallTime(0),
+            cpuTime(0) {}
+
+    // Seconds. CPU time is consumed by all process threads during the phase
+    double wallTime;
+    double cpuTime;
+};
+
+struct ChunkMetrics {
+    ChunkMetrics() :
+            entries(0),
+            bytes(0),
+            queueTime(0),
+            readTime(0),
+            sortTime(0),
+            writeTime(0),
+            ioWaitTime(0),
+            checksum(0) {}
+
+    uint64_t entries;
+    uint64_t bytes;
+    // Time between chunk task scheduling and its start
+    double queueTime;
+    // Time chunk file was read or mapped before sort, chunks sorted in memory have none
+    double readTime;
+    double sortTime;
+    double writeTime;
+    // Part of read and write time the thread was blocked
+    double ioWaitTime;
+    // Checksum of chunk file for checkpoint, computed only if requested from SortFunctor
+    uint64_t checksum;
+};
+
+struct SortMetrics {
+    SortMetrics() :
+            inMemorySort(false),
+            recordsRead(0),
+            bytesRead(0),
+            chunkBytesWritten(0),
+            chunkBytesRead(0),
+            residentRuns(0),
+            intermediateMerges(0),
+            distributionBuckets(0),
+            recordsWritten(0),
+            bytesWritten(0),
+            ioWaitTime(0),
+            queueWaitTime(0) {}
+
+    double mergeThroughput() const {
+        return mergeChunks.wallTime > 0 ? bytesWritten / mergeChunks.wallTime : 0;
+    }
+
+    PhaseMetrics createChunks;
+    PhaseMetrics sortChunks;
+    PhaseMetrics mergeChunks;
+
+    // Input was sorted in memory without chunk files
+    bool inMemorySort;
+
+    uint64_t recordsRead;
+    uint64_t bytesRead;
+    uint64_t chunkBytesWritten;
+    uint64_t chunkBytesRead;
+    // Chunks merged from memory without chunk files
+    uint64_t residentRuns;
+    // Merges of chunks done in background while input was read
+    uint64_t intermediateMerges;
+    // Buckets of distribution sort
+    uint64_t distributionBuckets;
+    uint64_t recordsWritten;
+    uint64_t bytesWritten;
+
+    std::vector<ChunkMetrics> chunks;
+
+    // Time threads spent off CPU inside reading and writing code
+    double ioWaitTime;
+    // Time chunk tasks spent in thread pool queue plus time reader waited for them
+    double queueWaitTime;
+};
+
+namespace _Impl {
+
+inline double currentCpuTime(clockid_t clockId) {
+    timespec time;
+    clock_gettime(clockId, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+class Stopwatch {
+public:
+    explicit Stopwatch(clockid_t cpuClock = CLOCK_THREAD_CPUTIME_ID) :
+            cpuClockId(cpuClock) {
+        restart();
+    }
+
+    void restart() {
+        wallStart = std::chrono::steady_clock::now();
+        cpuStart = currentCpuTime(cpuClockId);
+    }
+
+    double wallTime() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    }
+
+    double cpuTime() const {
+        return currentCpuTime(cpuClockId) - cpuStart;
+    }
+
+    // Wall time not spent on CPU, i.e. blocked time
+    double waitTime() const {
+        double wait = wallTime() - cpuTime();
+        return wait > 0 ? wait : 0;
+    }
+
+private:
+    clockid_t cpuClockId;
+    std::chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+};
+
+// Thread safe front end for optional SortMetrics
+class MetricsRecorder {
+public:
+    explicit MetricsRecorder(SortMetrics* m) :
+            metrics(m) {}
+
+    bool enabled() const {
+        return metrics;
+    }
+
+    template <typename Function>
+    void update(Function function) {
+        if (metrics) {
+            std::unique_lock<std::mutex> lock(mutex);
+            function(*metrics);
+        }
+    }
+
+    void addChunk(size_t index, const ChunkMetrics& chunk) {
+        update([index, &chunk](SortMetrics& m) {
+            if (m.chunks.size() <= index) {
+                m.chunks.resize(index + 1);
+            }
+
+            m.chunks[index] = chunk;
+            m.chunkBytesWritten += chunk.bytes;
+            m.ioWaitTime += chunk.ioWaitTime;
+            m.queueWaitTime += chunk.queueTime;
+        });
+    }
+
+    void addIoWait(double time) {
+        update([time](SortMetrics& m) {
+            m.ioWaitTime += time;
+        });
+    }
+
+    void addQueueWait(double time) {
+        update([time](SortMetrics& m) {
+            m.queueWaitTime += time;
+        });
+    }
+
+private:
+    SortMetrics* metrics;
+    std::mutex mutex;
+};
+
+class PhaseTimer {
+public:
+    PhaseTimer(MetricsRecorder& rec, PhaseMetrics SortMetrics::* ph) :
+            recorder(rec),
+            phase(ph),
+            stopwatch(CLOCK_PROCESS_CPUTIME_ID) {}
+
+    void stop() {
+        double wall = stopwatch.wallTime();
+        double cpu = stopwatch.cpuTime();
+        PhaseMetrics SortMetrics::* ph = phase;
+
+        recorder.update([wall, cpu, ph](SortMetrics& m) {
+            (m.*ph).wallTime += wall;
+            (m.*ph).cpuTime += cpu;
+        });
+    }
+
+private:
+    MetricsRecorder& recorder;
+    PhaseMetrics SortMetrics::* phase;
+    Stopwatch stopwatch;
+};
+
+inline void writeJson(std::ostream& out, const char* name, const PhaseMetrics& phase) {
+    out << "\"" << name << "\": {\"wall_time\": " << phase.wallTime << ", \"cpu_time\": " << phase.cpuTime << "}";
+}
+
+}
+
+inline void writeJson(std::ostream& out, const SortMetrics& metrics) {
+    out << "{\n";
+
+    // Phases which didn't run are left out, e.g. externalSort sorts chunks while creating them
+    const std::pair<const char*, const PhaseMetrics*> phases[] = {
+        std::make_pair("create_chunks", &metrics.createChunks),
+        std::make_pair("sort_chunks", &metrics.sortChunks),
+        std::make_pair("merge_chunks", &metrics.mergeChunks)
+    };
+    for (const std::pair<const char*, const PhaseMetrics*>& phase : phases) {
+        if (phase.second->wallTime > 0) {
+            out << "  ";
+            _Impl::writeJson(out, phase.first, *phase.second);
+            out << ",\n";
+        }
+    }
+
+    out << "  \"in_memory_sort\": " << (metrics.inMemorySort ? "true" : "false") << ",\n";
+    out << "  \"records_read\": " << metrics.recordsRead << ",\n";
+    out << "  \"bytes_read\": " << metrics.bytesRead << ",\n";
+    out << "  \"chunk_bytes_written\": " << metrics.chunkBytesWritten << ",\n";
+    out << "  \"chunk_bytes_read\": " << metrics.chunkBytesRead << ",\n";
+    out << "  \"resident_runs\": " << metrics.residentRuns << ",\n";
+    out << "  \"intermediate_merges\": " << metrics.intermediateMerges << ",\n";
+    out << "  \"distribution_buckets\": " << metrics.distributionBuckets << ",\n";
+    out << "  \"records_written\": " << metrics.recordsWritten << ",\n";
+    out << "  \"bytes_written\": " << metrics.bytesWritten << ",\n";
+    out << "  \"merge_throughput\": " << metrics.mergeThroughput() << ",\n";
+    out << "  \"io_wait_time\": " << metrics.ioWaitTime << ",\n";
+    out << "  \"queue_wait_time\": " << metrics.queueWaitTime << ",\n";
+
+    out << "  \"chunks\": [";
+    for (size_t i = 0; i < metrics.chunks.size(); ++i) {
+        const ChunkMetrics& chunk = metrics.chunks[i];
+        out << (i ? ",\n" : "\n");
+        out << "    {\"entries\": " << chunk.entries << ", \"bytes\": " << chunk.bytes
+            << ", \"queue_time\": " << chunk.queueTime << ", \"read_time\": " << chunk.readTime
+            << ", \"sort_time\": " << chunk.sortTime
+            << ", \"write_time\": " << chunk.writeTime << ", \"io_wait_time\": " << chunk.ioWaitTime << "}";
+    }
+    out << (metrics.chunks.empty() ? "]\n" : "\n  ]\n");
+
+    out << "}\n";
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <exception.h>
 #include <noncopyable.h>
 
 #include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -13,14 +17,21 @@ class ReadOnlyMemMapper : Noncopyable {
 public:
     explicit ReadOnlyMemMapper(const std::string& fName) :
         fileName(fName),
-        fileFd(0),
+        fileFd(-1),
         beginPtr(0),
         endPtr(0),
         maped(false),
-        mapSize(0) {}
+        mapPtr(0),
+        mapSize(0),
+        mapOffset(0),
+        fileSize(0) {}
 
     ~ReadOnlyMemMapper() {
         unmap();
+
+        if (fileFd != -1) {
+            close(fileFd);
+        }
     }
 
     const char* getBeginPtr() const {
@@ -31,39 +42,106 @@ public:
         return endPtr;
     }
 
+    // File offset of begin pointer
+    uint64_t getOffset() const {
+        return mapOffset;
+    }
+
+    uint64_t getFileSize() {
+        open();
+        return fileSize;
+    }
+
     void map() {
         if (!maped) {
-            struct stat fileStat;
-            stat(fileName.c_str(), &fileStat);
+            mapWindow(0, getFileSize());
+        }
+    }
 
-            mapSize = fileStat.st_size;
+    // Maps part of file [offset, offset + size), begin pointer points to offset
+    void mapWindow(uint64_t offset, uint64_t size) {
+        open();
+        unmap();
 
-            fileFd = open(fileName.c_str(), O_RDONLY);
+        if (offset > fileSize) {
+            throw Exception() << "Can't map" << fileName << "from" << offset << "because it is out of bounds";
+        }
 
-            if (fileFd == -1) {
-                throw Exception() << "Can't open file" << fileName << "for mapping" << strerror(errno);
-            }
+        uint64_t alignedOffset = offset - offset % pageSize();
+        uint64_t endOffset = size < fileSize - offset ? offset + size : fileSize;
 
-            beginPtr = reinterpret_cast<char*>(::mmap(0, mapSize, PROT_READ, MAP_SHARED, fileFd, 0));
-            endPtr = beginPtr + mapSize;
+        mapOffset = offset;
+        mapSize = endOffset - alignedOffset;
 
-            if (!beginPtr) {
-                close(fileFd);
+        if (mapSize) {
+            void* ptr = ::mmap(0, mapSize, PROT_READ, MAP_SHARED, fileFd, alignedOffset);
+
+            if (ptr == MAP_FAILED) {
                 throw Exception() << "Can't map file" << fileName << strerror(errno);
             }
 
-            maped = true;
+            mapPtr = reinterpret_cast<char*>(ptr);
+        }
+
+        beginPtr = mapPtr + (offset - alignedOffset);
+        endPtr = mapPtr + mapSize;
+
+        maped = true;
+    }
+
+    // madvise for mapped pages
+    void advise(int advice) {
+        if (maped && mapSize) {
+            ::madvise(mapPtr, mapSize, advice);
+        }
+    }
+
+    // posix_fadvise for any file range, e.g. to drop or prefetch page cache out of window
+    void adviseFile(uint64_t offset, uint64_t size, int advice) {
+        if (fileFd != -1 && size) {
+            ::posix_fadvise(fileFd, offset, size, advice);
         }
     }
 
     void unmap() {
         if (maped) {
-            ::munmap(beginPtr, mapSize);
-            close(fileFd);
+            if (mapSize) {
+                ::munmap(mapPtr, mapSize);
+            }
 
+            mapPtr = 0;
+            mapSize = 0;
             beginPtr = 0;
             endPtr = 0;
+            maped = false;
+        }
+    }
+
+    static uint64_t pageSize() {
+        static const uint64_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+private:
+    void open() {
+        if (fileFd != -1) {
+            return;
+        }
+
+        fileFd = ::open(fileName.c_str(), O_RDONLY);
+
+        if (fileFd == -1) {
+            throw Exception() << "Can't open file" << fileName << "for mapping" << strerror(errno);
+        }
+
+        struct stat fileStat;
+        if (fstat(fileFd, &fileStat) != 0) {
+            close(fileFd);
+            fileFd = -1;
+            throw Exception() << "Can't stat file" << fileName << strerror(errno);
         }
+
+        fileSize = fileStat.st_size;
     }
 
 private:
@@ -72,5 +150,72 @@ private:
     char* beginPtr;
     char* endPtr;
     bool maped;
-    size_t mapSize;
+    char* mapPtr;
+    uint64_t mapSize;
+    uint64_t mapOffset;
+    uint64_t fileSize;
+};
+
+// Whole file mapped for reading and writing, changes of mapping are written back to
+// the file by kernel. File size isn't changed.
+class SharedMemMapper : Noncopyable {
+public:
+    explicit SharedMemMapper(const std::string& fName) :
+            fileName(fName),
+            fileFd(-1),
+            mapPtr(0),
+            mapSize(0) {
+        fileFd = ::open(fileName.c_str(), O_RDWR);
+
+        if (fileFd == -1) {
+            throw Exception() << "Can't open file" << fileName << "for mapping" << strerror(errno);
+        }
+
+        struct stat fileStat;
+        if (fstat(fileFd, &fileStat) != 0) {
+            close(fileFd);
+            throw Exception() << "Can't stat file" << fileName << strerror(errno);
+        }
+
+        mapSize = fileStat.st_size;
+
+        if (mapSize) {
+            void* ptr = ::mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileFd, 0);
+
+            if (ptr == MAP_FAILED) {
+                close(fileFd);
+                throw Exception() << "Can't map file" << fileName << strerror(errno);
+            }
+
+            mapPtr = reinterpret_cast<char*>(ptr);
+        }
+    }
+
+    ~SharedMemMapper() {
+        if (mapSize) {
+            ::munmap(mapPtr, mapSize);
+        }
+
+        close(fileFd);
+    }
+
+    char* getBeginPtr() const {
+        return mapPtr;
+    }
+
+    uint64_t getSize() const {
+        return mapSize;
+    }
+
+    void advise(int advice) {
+        if (mapSize) {
+            ::madvise(mapPtr, mapSize, advice);
+        }
+    }
+
+private:
+    std::string fileName;
+    int fileFd;
+    char* mapPtr;
+    uint64_t mapSize;
 };
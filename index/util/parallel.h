@@ -0,0 +1,223 @@
+#pragma once
+
+#include <threadpool.h>
+
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <vector>
+
+namespace _Impl {
+
+// Split range into blocks, several blocks per thread for load balancing
+inline size_t parallelBlockCount(const ThreadPool& threadPool, size_t size, size_t grainSize) {
+    if (!grainSize) {
+        grainSize = 1;
+    }
+
+    size_t maxBlocks = std::max<size_t>(threadPool.size(), 1) * 4;
+    size_t blocks = std::min(maxBlocks, (size + grainSize - 1) / grainSize);
+
+    return std::max<size_t>(blocks, 1);
+}
+
+inline size_t parallelBlockBegin(size_t begin, size_t size, size_t blockCount, size_t block) {
+    return begin + size * block / blockCount;
+}
+
+inline void parallelInvokeImpl(TaskGroup&) {}
+
+template <typename Function>
+void parallelInvokeImpl(TaskGroup&, Function&& function) {
+    // Last function is executed by calling thread
+    function();
+}
+
+template <typename Function, typename... Functions>
+void parallelInvokeImpl(TaskGroup& group, Function&& function, Functions&&... functions) {
+    group.run(std::forward<Function>(function));
+    parallelInvokeImpl(group, std::forward<Functions>(functions)...);
+}
+
+}
+
+// Calls function(index) for each index in [begin, end)
+template <typename Function>
+void parallelFor(ThreadPool& threadPool, size_t begin, size_t end, Function function, size_t grainSize = 1) {
+    if (begin >= end) {
+        return;
+    }
+
+    const size_t size = end - begin;
+    const size_t blockCount = _Impl::parallelBlockCount(threadPool, size, grainSize);
+
+    TaskGroup group(threadPool);
+
+    for (size_t block = 0; block < blockCount; ++block) {
+        size_t blockBegin = _Impl::parallelBlockBegin(begin, size, blockCount, block);
+        size_t blockEnd = _Impl::parallelBlockBegin(begin, size, blockCount, block + 1);
+
+        group.run([blockBegin, blockEnd, &function]() {
+            for (size_t index = blockBegin; index < blockEnd; ++index) {
+                function(index);
+            }
+        });
+    }
+
+    group.wait();
+}
+
+// Computes map(rangeBegin, rangeEnd) for disjoint subranges of [begin, end)
+// and combines results with reduce in range order
+template <typename T, typename MapFunction, typename ReduceFunction>
+T parallelReduce(ThreadPool& threadPool, size_t begin, size_t end, const T& identity,
+        MapFunction map, ReduceFunction reduce, size_t grainSize = 1) {
+    if (begin >= end) {
+        return identity;
+    }
+
+    const size_t size = end - begin;
+    const size_t blockCount = _Impl::parallelBlockCount(threadPool, size, grainSize);
+
+    std::deque<T> results(blockCount, identity);
+
+    TaskGroup group(threadPool);
+
+    for (size_t block = 0; block < blockCount; ++block) {
+        size_t blockBegin = _Impl::parallelBlockBegin(begin, size, blockCount, block);
+        size_t blockEnd = _Impl::parallelBlockBegin(begin, size, blockCount, block + 1);
+        T* result = &results[block];
+
+        group.run([blockBegin, blockEnd, result, &map]() {
+            *result = map(blockBegin, blockEnd);
+        });
+    }
+
+    group.wait();
+
+    T result = identity;
+    for (const T& value : results) {
+        result = reduce(result, value);
+    }
+
+    return result;
+}
+
+// Executes all functions concurrently and waits them
+template <typename... Functions>
+void parallelInvoke(ThreadPool& threadPool, Functions&&... functions) {
+    TaskGroup group(threadPool);
+
+    try {
+        _Impl::parallelInvokeImpl(group, std::forward<Functions>(functions)...);
+    } catch (...) {
+        try {
+            group.wait();
+        } catch (...) {
+        }
+
+        throw;
+    }
+
+    group.wait();
+}
+
+namespace _Impl {
+
+// Count of entries taken from first range into first rank entries of stable merge of two ranges
+template <typename RandomAccessIterator>
+size_t mergeCoRank(RandomAccessIterator first, size_t firstSize, RandomAccessIterator second, size_t secondSize,
+        size_t rank) {
+    size_t low = rank > secondSize ? rank - secondSize : 0;
+    size_t high = std::min(rank, firstSize);
+
+    while (low < high) {
+        size_t taken = (low + high) / 2;
+        // Entry of first range goes before equal entry of second one
+        if (!(second[rank - taken - 1] < first[taken])) {
+            low = taken + 1;
+        } else {
+            high = taken;
+        }
+    }
+
+    return low;
+}
+
+// Merges pairs of neighbouring sorted parts of width parts each from source into destination.
+// Every merge is cut by co-ranks into pieces merged concurrently, so the last merges
+// use all threads too. Part without pair is moved as is.
+template <typename SourceIterator, typename DestinationIterator>
+void parallelMergeParts(ThreadPool& threadPool, SourceIterator source, DestinationIterator destination,
+        const std::vector<size_t>& bounds, size_t width) {
+    const size_t partCount = bounds.size() - 1;
+    const size_t mergeCount = (partCount + 2 * width - 1) / (2 * width);
+    const size_t pieceCount = std::max<size_t>(threadPool.size() / mergeCount, 1);
+
+    parallelFor(threadPool, 0, mergeCount * pieceCount, [&](size_t task) {
+        const size_t first = task / pieceCount * 2 * width;
+        const size_t piece = task % pieceCount;
+
+        const size_t begin = bounds[first];
+        const size_t middle = bounds[std::min(first + width, partCount)];
+        const size_t end = bounds[std::min(first + 2 * width, partCount)];
+
+        const size_t pieceBegin = (end - begin) * piece / pieceCount;
+        const size_t pieceEnd = (end - begin) * (piece + 1) / pieceCount;
+
+        const size_t firstBegin = mergeCoRank(source + begin, middle - begin, source + middle, end - middle, pieceBegin);
+        const size_t firstEnd = mergeCoRank(source + begin, middle - begin, source + middle, end - middle, pieceEnd);
+
+        std::merge(std::make_move_iterator(source + begin + firstBegin),
+                std::make_move_iterator(source + begin + firstEnd),
+                std::make_move_iterator(source + middle + (pieceBegin - firstBegin)),
+                std::make_move_iterator(source + middle + (pieceEnd - firstEnd)),
+                destination + begin + pieceBegin);
+    });
+}
+
+}
+
+// Sorts parts of range concurrently with sort function and merges them pairwise through
+// buffer of range size, every merge is done by all threads
+template <typename RandomAccessIterator, typename SortFunction>
+void parallelSort(ThreadPool& threadPool, RandomAccessIterator begin, RandomAccessIterator end, SortFunction sort) {
+    const size_t MIN_PART_SIZE = 1 << 12;
+
+    const size_t size = end - begin;
+    const size_t partCount = std::max<size_t>(std::min(std::max<size_t>(threadPool.size(), 1), size / MIN_PART_SIZE), 1);
+
+    if (partCount == 1) {
+        sort(begin, end);
+        return;
+    }
+
+    std::vector<size_t> bounds(partCount + 1);
+    for (size_t part = 0; part <= partCount; ++part) {
+        bounds[part] = _Impl::parallelBlockBegin(0, size, partCount, part);
+    }
+
+    parallelFor(threadPool, 0, partCount, [&](size_t part) {
+        sort(begin + bounds[part], begin + bounds[part + 1]);
+    });
+
+    std::vector<typename std::iterator_traits<RandomAccessIterator>::value_type> buffer(size);
+
+    // Merged parts go back and forth between range and buffer
+    bool inBuffer = false;
+    for (size_t width = 1; width < partCount; width *= 2) {
+        if (inBuffer) {
+            _Impl::parallelMergeParts(threadPool, buffer.begin(), begin, bounds, width);
+        } else {
+            _Impl::parallelMergeParts(threadPool, begin, buffer.begin(), bounds, width);
+        }
+
+        inBuffer = !inBuffer;
+    }
+
+    if (inBuffer) {
+        parallelFor(threadPool, 0, partCount, [&](size_t part) {
+            std::move(buffer.begin() + bounds[part], buffer.begin() + bounds[part + 1], begin + bounds[part]);
+        });
+    }
+}
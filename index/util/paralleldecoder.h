@@ -0,0 +1,251 @@
+#pragma once
+
+#include <arena.h>
+#include <exception.h>
+#include <memarchive.h>
+#include <mmapper.h>
+#include <noncopyable.h>
+#include <parallel.h>
+#include <serializer.h>
+#include <threadpool.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Variable length records have no index, so split points are guessed: segment
+// of file is cut into equal ranges, every cut is moved forward to the first
+// position where a chain of valid record headers starts. Ranges are decoded
+// concurrently. Guess is right if range is decoded exactly up to the next cut,
+// otherwise the range is decoded sequentially up to the first record which ends at
+// or after the next cut, and the rest of file is cut again from there.
+
+// Payloads of decoded entries are allocated from an arena of every decoded range
+// if it is enabled (see ArenaPlacement), arenas are shared by entries decoded to them
+class DecodeArenas {
+public:
+    explicit DecodeArenas(bool enable = false, bool hugePgs = false) :
+            enabled(enable),
+            hugePages(hugePgs) {}
+
+    std::shared_ptr<Arena> create() const {
+        return enabled ? std::make_shared<Arena>(Arena::DEFAULT_BLOCK_SIZE, hugePages) : std::shared_ptr<Arena>();
+    }
+
+private:
+    bool enabled;
+    bool hugePages;
+};
+
+namespace _Impl {
+
+enum {
+    RECORD_CHAIN_LENGTH = 16
+};
+
+template <typename EntryType>
+bool isRecordChainStart(const char* ptr, const char* end) {
+    for (size_t i = 0; i < RECORD_CHAIN_LENGTH && ptr != end; ++i) {
+        uint64_t size = RecordBoundary<EntryType>::recordSize(ptr, end);
+        if (!size) {
+            return false;
+        }
+
+        ptr += size;
+    }
+
+    return true;
+}
+
+template <typename EntryType>
+const char* findRecordBoundary(const char* from, const char* end) {
+    for (; from < end; ++from) {
+        if (isRecordChainStart<EntryType>(from, end)) {
+            return from;
+        }
+    }
+
+    return end;
+}
+
+// Decoded entries with offsets of their ends
+template <typename EntryType>
+struct DecodedRange {
+    std::vector<EntryType> entries;
+    std::vector<uint64_t> ends;
+    // Payloads of entries, if arenas are enabled
+    std::shared_ptr<Arena> arena;
+};
+
+template <typename EntryType>
+void decodeEntry(EntryType& data, MemoryInArchive& inArchive, Arena* arena) {
+    if (arena) {
+        ArenaPlacement<EntryType>::read(data, inArchive, *arena);
+    } else {
+        deserialize(data, inArchive);
+    }
+}
+
+// Returns false if records don't end exactly at end. Offsets are relative to base.
+template <typename EntryType>
+bool decodeRange(const char* base, const char* begin, const char* end, DecodedRange<EntryType>& range) {
+    const char* ptr = begin;
+
+    while (ptr != end) {
+        uint64_t size = RecordBoundary<EntryType>::recordSize(ptr, end);
+        if (!size) {
+            return false;
+        }
+
+        MemoryInArchive inArchive(ptr, ptr + size);
+
+        EntryType data;
+        decodeEntry(data, inArchive, range.arena.get());
+
+        if (!isValid(data) || !inArchive.eof()) {
+            return false;
+        }
+
+        ptr += size;
+        range.entries.push_back(std::move(data));
+        range.ends.push_back(ptr - base);
+    }
+
+    return true;
+}
+
+template <typename EntryType, typename Function>
+void passDecodedRange(DecodedRange<EntryType>& range, Function& function) {
+    for (size_t i = 0; i < range.entries.size(); ++i) {
+        function(std::move(range.entries[i]), range.ends[i], range.arena);
+    }
+}
+
+// Decodes records from begin until one ends at or after stop, returns end of that record
+template <typename EntryType, typename Function>
+const char* decodeSequentially(const char* base, const char* begin, const char* stop, const char* end,
+        const DecodeArenas& arenas, Function& function) {
+    MemoryInArchive inArchive(begin, end);
+    std::shared_ptr<Arena> arena = arenas.create();
+
+    while (!inArchive.eof() && begin + inArchive.pos() < stop) {
+        EntryType data;
+        decodeEntry(data, inArchive, arena.get());
+
+        if (!isValid(data)) {
+            throw Exception() << "Read data is not valid";
+        }
+
+        function(std::move(data), (begin - base) + inArchive.pos(), arena);
+    }
+
+    return begin + inArchive.pos();
+}
+
+}
+
+// Calls function(EntryType&&, endOffset, arena) for every record of buffer in order, records
+// are decoded by pool threads segment by segment. endOffset is offset of record end from begin,
+// arena is shared pointer to arena of entry payload, null if arenas aren't enabled.
+template <typename EntryType, typename Function>
+void parallelDecode(ThreadPool& threadPool, const char* begin, const char* end, Function function, size_t segmentSize,
+        const DecodeArenas& arenas = DecodeArenas()) {
+    const size_t partCount = std::max<size_t>(threadPool.size(), 1);
+
+    const char* segmentBegin = begin;
+
+    while (segmentBegin != end) {
+        const size_t size = std::min<uint64_t>(segmentSize, end - segmentBegin);
+
+        std::vector<const char*> bounds(1, segmentBegin);
+        for (size_t part = 1; part <= partCount; ++part) {
+            const char* cut = segmentBegin + size * part / partCount;
+            bounds.push_back(cut == end ? end : _Impl::findRecordBoundary<EntryType>(std::max(cut, bounds.back()), end));
+        }
+
+        std::vector< _Impl::DecodedRange<EntryType> > parts(partCount);
+        std::deque<bool> decoded(partCount, false);
+
+        parallelFor(threadPool, 0, partCount, [&](size_t part) {
+            parts[part].arena = arenas.create();
+            decoded[part] = _Impl::decodeRange<EntryType>(begin, bounds[part], bounds[part + 1], parts[part]);
+        });
+
+        segmentBegin = bounds.back();
+
+        for (size_t part = 0; part < partCount; ++part) {
+            if (decoded[part]) {
+                _Impl::passDecodedRange(parts[part], function);
+                continue;
+            }
+
+            // Next cut isn't a real boundary, ranges after it are right only if
+            // sequential decoding ends exactly at that cut
+            const char* decodedEnd = _Impl::decodeSequentially<EntryType>(begin, bounds[part], bounds[part + 1], end,
+                    arenas, function);
+            if (decodedEnd != bounds[part + 1]) {
+                segmentBegin = decodedEnd;
+                break;
+            }
+        }
+    }
+}
+
+// Maps whole file and decodes it with parallelDecode, has pos() like archives
+template <typename EntryType>
+class ParallelFileDecoder : Noncopyable {
+public:
+    enum {
+        DEFAULT_SEGMENT_SIZE = 1 << 26
+    };
+
+    ParallelFileDecoder(const std::string& fileName, ThreadPool& pool, size_t segSize = DEFAULT_SEGMENT_SIZE) :
+            mMapper(fileName),
+            threadPool(pool),
+            segmentSize(segSize),
+            startOffset(0),
+            decodedSize(0) {
+        mMapper.map();
+        mMapper.advise(MADV_SEQUENTIAL);
+    }
+
+    // Records are decoded from this offset, it must be record boundary
+    void skip(uint64_t bytes) {
+        startOffset = std::min<uint64_t>(startOffset + bytes, mMapper.getEndPtr() - mMapper.getBeginPtr());
+        decodedSize = startOffset;
+    }
+
+    // Calls function(EntryType&&, endPos) for every record, endPos is file offset of record end
+    template <typename Function>
+    void forEach(Function function) {
+        forEach(DecodeArenas(), [&function](EntryType&& entry, uint64_t endPos, const std::shared_ptr<Arena>&) {
+            function(std::move(entry), endPos);
+        });
+    }
+
+    // Calls function(EntryType&&, endPos, arena), payload of entry is in arena if arenas are enabled
+    template <typename Function>
+    void forEach(const DecodeArenas& arenas, Function function) {
+        const uint64_t offset = startOffset;
+        parallelDecode<EntryType>(threadPool, mMapper.getBeginPtr() + offset, mMapper.getEndPtr(),
+                [&function, offset](EntryType&& entry, uint64_t endOffset, const std::shared_ptr<Arena>& arena) {
+                    function(std::move(entry), offset + endOffset, arena);
+                },
+                segmentSize, arenas);
+        decodedSize = mMapper.getEndPtr() - mMapper.getBeginPtr();
+    }
+
+    uint64_t pos() const {
+        return decodedSize;
+    }
+
+private:
+    ReadOnlyMemMapper mMapper;
+    ThreadPool& threadPool;
+    const size_t segmentSize;
+    uint64_t startOffset;
+    uint64_t decodedSize;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chunkdir.h>
 #include <filearchive.h>
 #include <noncopyable.h>
 
@@ -73,9 +74,7 @@ public:
 
 private:
     std::string getChunkFileName() const {
-        std::stringstream sstr;
-        sstr << chunkDir << "/chunk_" << chunkCounter << ".dat";
-        return sstr.str();
+        return stripedChunkFileName(chunkDir, "chunk_", chunkCounter);
     }
 
     void createNextFileArchive() {
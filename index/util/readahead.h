@@ -0,0 +1,230 @@
+#pragma once
+
+#include <noncopyable.h>
+#include <serializer.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Merge input reading every run by large blocks in background. Each run has
+// the block merge consumes and the next block. When merge starts consuming a
+// block the next one is requested. One I/O thread serves requests in order of
+// forecast: run whose current block ends with the smallest entry is exhausted
+// first. So merge of many runs reads large sequential pieces of files instead
+// of faulting pages of all runs in turn.
+
+namespace _Impl {
+
+template <typename EntryType, typename InArchive>
+struct ReadAheadRunState : Noncopyable {
+    explicit ReadAheadRunState(InArchive* archive) :
+            source(archive),
+            currentPos(0),
+            nextReady(false),
+            sourceEnded(false),
+            hasForecast(false) {}
+
+    std::unique_ptr<InArchive> source;
+    // Consumed by merge thread
+    std::vector<EntryType> current;
+    size_t currentPos;
+    // Filled by I/O thread, handed over under scheduler mutex
+    std::vector<EntryType> next;
+    bool nextReady;
+    bool sourceEnded;
+    std::exception_ptr error;
+    // Last entry of current block, requests without forecast go first
+    bool hasForecast;
+    EntryType forecast;
+};
+
+}
+
+template <typename EntryType, typename InArchive>
+class ReadAheadScheduler;
+
+// Run of ReadAheadScheduler, is given to Merger instead of archive
+template <typename EntryType, typename InArchive>
+class ReadAheadRun {
+public:
+    typedef _Impl::ReadAheadRunState<EntryType, InArchive> State;
+
+    ReadAheadRun(ReadAheadScheduler<EntryType, InArchive>& runScheduler, const std::shared_ptr<State>& runState) :
+            scheduler(&runScheduler),
+            state(runState) {}
+
+    bool next(EntryType& entry) {
+        if (state->currentPos == state->current.size() && !scheduler->nextBlock(*state)) {
+            return false;
+        }
+
+        entry = std::move(state->current[state->currentPos++]);
+        return true;
+    }
+
+private:
+    ReadAheadScheduler<EntryType, InArchive>* scheduler;
+    std::shared_ptr<State> state;
+};
+
+template <typename EntryType, typename InArchive>
+bool readMergeItem(EntryType& entry, ReadAheadRun<EntryType, InArchive>& run) {
+    return run.next(entry);
+}
+
+template <typename EntryType, typename InArchive>
+class ReadAheadScheduler : Noncopyable {
+    typedef _Impl::ReadAheadRunState<EntryType, InArchive> State;
+
+    struct Request {
+        State* state;
+
+        bool operator < (const Request& other) const {
+            // Make min heap by forecast
+            if (state->hasForecast != other.state->hasForecast) {
+                return state->hasForecast;
+            }
+
+            return state->hasForecast && other.state->forecast < state->forecast;
+        }
+    };
+
+public:
+    typedef ReadAheadRun<EntryType, InArchive> Run;
+
+    enum {
+        DEFAULT_BLOCK_SIZE = 1 << 22
+    };
+
+    explicit ReadAheadScheduler(uint64_t blckSize = DEFAULT_BLOCK_SIZE) :
+            blockSize(blckSize),
+            stopped(false),
+            ioThread(&ReadAheadScheduler::readBlocks, this) {}
+
+    ~ReadAheadScheduler() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        condition.notify_all();
+        ioThread.join();
+    }
+
+    // Archive is constructed with args, first block is requested at once
+    template <typename... Args>
+    Run addRun(Args&&... args) {
+        std::shared_ptr<State> state(new State(new InArchive(std::forward<Args>(args)...)));
+
+        std::unique_lock<std::mutex> lock(mutex);
+        states.push_back(state);
+        requests.push(Request{state.get()});
+        condition.notify_all();
+
+        return Run(*this, state);
+    }
+
+    // Makes next block current and requests the one after it
+    bool nextBlock(State& state) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // The last block is consumed
+        if (state.sourceEnded && !state.nextReady) {
+            return false;
+        }
+
+        condition.wait(lock, [&state]() {
+            return state.nextReady;
+        });
+
+        if (state.error) {
+            std::rethrow_exception(state.error);
+        }
+
+        state.current.swap(state.next);
+        state.currentPos = 0;
+        state.nextReady = false;
+
+        if (state.current.empty()) {
+            return false;
+        }
+
+        if (!state.sourceEnded) {
+            state.hasForecast = true;
+            state.forecast = state.current.back();
+            requests.push(Request{&state});
+            condition.notify_all();
+        }
+
+        return true;
+    }
+
+private:
+    void readBlocks() {
+        while (true) {
+            State* state = 0;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() {
+                    return stopped || !requests.empty();
+                });
+
+                if (stopped) {
+                    return;
+                }
+
+                state = requests.top().state;
+                requests.pop();
+            }
+
+            // Merge thread doesn't touch next block until it is ready
+            bool ended = false;
+            std::exception_ptr error;
+            try {
+                ended = readBlock(*state->source, state->next);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                state->sourceEnded = ended;
+                state->error = error;
+                state->nextReady = true;
+            }
+
+            condition.notify_all();
+        }
+    }
+
+    // Returns true if archive is ended
+    bool readBlock(InArchive& source, std::vector<EntryType>& block) {
+        block.clear();
+
+        const uint64_t startPos = source.pos();
+        while (!source.eof() && source.pos() - startPos < blockSize) {
+            block.push_back(EntryType());
+            deserialize(block.back(), source);
+        }
+
+        return source.eof();
+    }
+
+private:
+    const uint64_t blockSize;
+    std::list< std::shared_ptr<State> > states;
+    std::priority_queue<Request> requests;
+    bool stopped;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread ioThread;
+};
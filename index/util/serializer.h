@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <type_traits>
 
 template <typename T>
@@ -7,6 +9,27 @@ struct IsClassSerializable {
     static const bool value = false;
 };
 
+// Serialized form of bitwise serializable types is their memory image, so arrays
+// of them are written and read by one copy. Plain POD types are bitwise serializable,
+// class types specialize it if serialize writes exactly sizeof(T) bytes of the object
+// (packed layout, no pointers).
+template <typename T>
+struct IsBitwiseSerializable {
+    static const bool value = std::is_pod<T>::value && !IsClassSerializable<T>::value;
+};
+
+// Serialized records of splittable types can be found in the middle of a file,
+// recordSize(ptr, end) returns size of a record starting at ptr or 0 if ptr
+// doesn't look like a record start
+template <typename T>
+struct RecordBoundary {
+    static const bool splittable = false;
+
+    static uint64_t recordSize(const char*, const char*) {
+        return 0;
+    }
+};
+
 template <typename Item, typename OutArchive>
 void serialize(const Item& item, OutArchive& out, typename std::enable_if<!IsClassSerializable<Item>::value>::type * = 0) {
     out.write(item);
@@ -36,3 +59,41 @@ template <typename Item>
 bool isValid(const Item& item, typename std::enable_if<IsClassSerializable<Item>::value>::type * = 0) {
     return item.isValid();
 }
+
+template <typename Item, typename OutArchive>
+void serializeArray(const Item* items, size_t count, OutArchive& out) {
+    if (IsBitwiseSerializable<Item>::value) {
+        if (count) {
+            out.write(reinterpret_cast<const char*>(items), sizeof(Item) * count);
+        }
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            serialize(items[i], out);
+        }
+    }
+}
+
+template <typename Item, typename InArchive>
+void deserializeArray(Item* items, size_t count, InArchive& in) {
+    if (IsBitwiseSerializable<Item>::value) {
+        if (count) {
+            in.read(reinterpret_cast<char*>(items), sizeof(Item) * count);
+        }
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            deserialize(items[i], in);
+        }
+    }
+}
+
+// Reads only the fixed part of record keys are made of and skips the rest of it,
+// e.g. header of entry with payload. Types with such part specialize it.
+template <typename T>
+struct HeaderScan {
+    static const bool enabled = false;
+
+    template <typename InArchive>
+    static void read(T& item, InArchive& in) {
+        deserialize(item, in);
+    }
+};
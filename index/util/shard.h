@@ -0,0 +1,192 @@
+#pragma once
+
+#include <exception.h>
+#include <keytraits.h>
+#include <noncopyable.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Sharded output: file name.N for shard N, shards have disjoint key ranges
+// in order of shard number. name.manifest describes shards.
+
+inline std::string shardFileName(const std::string& outputFileName, size_t shard) {
+    std::stringstream sstr;
+    sstr << outputFileName << "." << shard;
+    return sstr.str();
+}
+
+inline std::string shardManifestFileName(const std::string& outputFileName) {
+    return outputFileName + ".manifest";
+}
+
+struct ShardInfo {
+    ShardInfo() :
+            entries(0),
+            bytes(0) {}
+
+    std::string fileName;
+    uint64_t entries;
+    uint64_t bytes;
+    // Keys of first and last entry
+    std::string firstKey;
+    std::string lastKey;
+};
+
+inline void writeShardManifest(const std::string& outputFileName, const std::vector<ShardInfo>& shards) {
+    std::string fileName = shardManifestFileName(outputFileName);
+    std::ofstream out(fileName.c_str());
+    if (!out) {
+        throw Exception() << "Can't open manifest file" << fileName;
+    }
+
+    out << "{\n  \"shards\": [";
+    for (size_t i = 0; i < shards.size(); ++i) {
+        const ShardInfo& shard = shards[i];
+        out << (i ? ",\n" : "\n");
+        out << "    {\"file\": \"" << shard.fileName << "\", \"entries\": " << shard.entries
+            << ", \"bytes\": " << shard.bytes << ", \"first_key\": \"" << shard.firstKey
+            << "\", \"last_key\": \"" << shard.lastKey << "\"}";
+    }
+    out << (shards.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+}
+
+// Every step-th entry of sorted run from step / 2 with its offset in run file
+template <typename T>
+struct RunSamples {
+    explicit RunSamples(uint64_t stp = 1) :
+            step(stp) {}
+
+    // Entries of run each sample stands for
+    uint64_t step;
+    std::vector<T> entries;
+    std::vector<uint64_t> offsets;
+};
+
+// Collects samples of sorted runs while they are written. Samples give
+// splitters of shards and sparse index to find shard bounds in every run.
+// Every run gives about the same number of samples whatever its size is.
+template <typename T>
+class RunSampler : Noncopyable {
+public:
+    enum {
+        DEFAULT_RUN_SAMPLES = 1 << 10
+    };
+
+    explicit RunSampler(size_t samplesPerRun = DEFAULT_RUN_SAMPLES) :
+            runSamples(std::max<size_t>(samplesPerRun, 1)) {}
+
+    // Step of samples of run with runSize entries
+    size_t step(uint64_t runSize) const {
+        return std::max<uint64_t>(runSize / runSamples, 1);
+    }
+
+    // Index of the first sample, samples in the middle of their steps don't
+    // stick to the smallest entries of runs
+    static size_t firstSample(size_t step) {
+        return step / 2;
+    }
+
+    void addRun(const std::string& fileName, RunSamples<T>&& samples) {
+        std::unique_lock<std::mutex> lock(mutex);
+        runs[fileName] = std::move(samples);
+    }
+
+    const RunSamples<T>& run(const std::string& fileName) const {
+        typename std::map<std::string, RunSamples<T> >::const_iterator it = runs.find(fileName);
+        if (it == runs.end()) {
+            throw Exception() << "Run" << fileName << "wasn't sampled";
+        }
+
+        return it->second;
+    }
+
+    // shardCount - 1 entries splitting samples of all runs to equal parts,
+    // samples are weighted by their steps, so small runs don't shift splitters
+    std::vector<T> splitters(size_t shardCount) const {
+        typedef std::pair<T, uint64_t> Sample;
+
+        std::vector<Sample> samples;
+        uint64_t totalWeight = 0;
+        typename std::map<std::string, RunSamples<T> >::const_iterator it = runs.begin();
+        for (; it != runs.end(); ++it) {
+            for (const T& entry : it->second.entries) {
+                samples.push_back(Sample(entry, it->second.step));
+                totalWeight += it->second.step;
+            }
+        }
+
+        std::sort(samples.begin(), samples.end(), [](const Sample& first, const Sample& second) {
+            return first.first < second.first;
+        });
+
+        std::vector<T> result;
+        uint64_t weight = 0;
+        size_t sample = 0;
+        for (size_t shard = 1; shard < shardCount && !samples.empty(); ++shard) {
+            const uint64_t shardBegin = totalWeight * shard / shardCount;
+            while (sample + 1 < samples.size() && weight + samples[sample].second <= shardBegin) {
+                weight += samples[sample].second;
+                ++sample;
+            }
+
+            result.push_back(samples[sample].first);
+        }
+
+        return result;
+    }
+
+private:
+    const size_t runSamples;
+    std::map<std::string, RunSamples<T> > runs;
+    std::mutex mutex;
+};
+
+// Reads [begin, end) range of archive
+template <typename InArchive>
+class RangeInArchive {
+public:
+    RangeInArchive(const InArchive& archive, uint64_t begin, uint64_t end) :
+            inArchive(archive),
+            endPos(end) {
+        inArchive.skip(begin);
+    }
+
+    template <typename T>
+    bool read(T& entry) {
+        return read(&entry, 1);
+    }
+
+    template <typename T>
+    bool read(T* ptr, size_t count) {
+        if (eof()) {
+            return false;
+        }
+
+        return inArchive.read(ptr, count);
+    }
+
+    bool eof() const {
+        return inArchive.pos() >= endPos || inArchive.eof();
+    }
+
+    uint64_t pos() const {
+        return inArchive.pos();
+    }
+
+    void skip(uint64_t bytes) {
+        inArchive.skip(bytes);
+    }
+
+private:
+    InArchive inArchive;
+    uint64_t endPos;
+};
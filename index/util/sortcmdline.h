@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cmdline.h>
+#include <exception.h>
+#include <metrics.h>
+#include <sorter.h>
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+// Options shared by sort and create_index utilities
+
+inline std::set<std::string> sortOptionNames() {
+    std::set<std::string> names;
+    names.insert("metrics");
+    names.insert("chunk-compression");
+    names.insert("memory-budget");
+    names.insert("mmap-window");
+    names.insert("shards");
+    names.insert("checkpoint");
+    names.insert("remove-chunks");
+    names.insert("merge-read-ahead");
+    names.insert("payload-arena");
+    names.insert("sparse-index");
+    names.insert("resident-runs");
+    names.insert("background-merge");
+    names.insert("distribution");
+    return names;
+}
+
+// Size with optional K, M or G suffix
+inline uint64_t parseSize(const std::string& value) {
+    std::istringstream sstr(value);
+
+    uint64_t size = 0;
+    if (!(sstr >> size)) {
+        throw Exception() << "Wrong size" << value;
+    }
+
+    std::string suffix;
+    sstr >> suffix;
+
+    if (suffix == "K") {
+        size <<= 10;
+    } else if (suffix == "M") {
+        size <<= 20;
+    } else if (suffix == "G") {
+        size <<= 30;
+    } else if (!suffix.empty()) {
+        throw Exception() << "Wrong size suffix" << suffix;
+    }
+
+    return size;
+}
+
+inline std::string sortOptionsUsage() {
+    return
+        "Options:\n"
+        "  --metrics=file_name              write pipeline metrics as JSON\n"
+        "  --chunk-compression=none|lz      compression of temporary chunk files\n"
+        "  --memory-budget=size[K|M|G]      sort: sort in memory if input fits the budget\n"
+        "  --mmap-window=size[K|M|G]        map input and chunk files by windows to bound memory usage\n"
+        "  --shards=count                   write output_file.N shards with disjoint key ranges and output_file.manifest\n"
+        "  --checkpoint                     sort: record finished chunks in tmp_data_dir, rerun resumes the sort\n"
+        "  --remove-chunks                  delete chunk files while and after they are merged\n"
+        "  --merge-read-ahead=size[K|M|G]   read every chunk by blocks of this size in background while merging\n"
+        "  --payload-arena[=huge]           keep payloads of chunk entries in arena, optionally of huge pages\n"
+        "  --sparse-index=step              write key and offset of every step-th output entry to out_file_name.sidx\n"
+        "  --resident-runs=count            sort: merge this number of last chunks from memory without writing them, default 1\n"
+        "  --background-merge=fan_in        sort: merge written chunks by fan_in in background while input is read\n"
+        "  --distribution                   sort: partition input into buckets by key instead of merging chunks\n";
+}
+
+// Metrics file name is given with --metrics option or as the optional positional argument after out_file_name
+inline std::string metricsFileName(const CommandLine& commandLine, size_t positionalIndex) {
+    if (commandLine.argCount() > positionalIndex) {
+        if (commandLine.hasOption("metrics")) {
+            throw Exception() << "Metrics file name is given twice";
+        }
+
+        return commandLine.arg(positionalIndex);
+    }
+
+    return commandLine.option("metrics", "");
+}
+
+inline SortOptions parseSortOptions(const CommandLine& commandLine, size_t positionalMetricsIndex,
+        SortMetrics* metrics) {
+    commandLine.checkOptions(sortOptionNames());
+
+    SortOptions options;
+
+    if (!metricsFileName(commandLine, positionalMetricsIndex).empty()) {
+        options.metrics = metrics;
+    }
+
+    std::string compression = commandLine.option("chunk-compression", "none");
+    if (compression == "lz") {
+        options.chunkCompression = LzChunkCompression;
+    } else if (compression != "none") {
+        throw Exception() << "Unknown chunk compression" << compression;
+    }
+
+    if (commandLine.hasOption("memory-budget")) {
+        options.memoryBudget = parseSize(commandLine.option("memory-budget"));
+    }
+
+    if (commandLine.hasOption("mmap-window")) {
+        options.mmapWindowSize = parseSize(commandLine.option("mmap-window"));
+    }
+
+    options.shardCount = commandLine.option<size_t>("shards", 0);
+    options.checkpoint = commandLine.hasOption("checkpoint");
+    options.removeChunks = commandLine.hasOption("remove-chunks");
+
+    if (commandLine.hasOption("merge-read-ahead")) {
+        options.mergeReadAhead = parseSize(commandLine.option("merge-read-ahead"));
+    }
+
+    options.sparseIndexStep = commandLine.option<size_t>("sparse-index", 0);
+    options.residentRuns = commandLine.option<size_t>("resident-runs", options.residentRuns);
+    options.backgroundMergeFanIn = commandLine.option<size_t>("background-merge", 0);
+    options.distributionSort = commandLine.hasOption("distribution");
+
+    if (commandLine.hasOption("payload-arena")) {
+        std::string arena = commandLine.option("payload-arena");
+        if (!arena.empty() && arena != "huge") {
+            throw Exception() << "Unknown payload arena" << arena;
+        }
+
+        options.payloadArena = true;
+        options.hugePages = arena == "huge";
+    }
+
+    return options;
+}
+
+inline void writeMetrics(const CommandLine& commandLine, size_t positionalMetricsIndex, const SortMetrics& metrics) {
+    std::string fileName = metricsFileName(commandLine, positionalMetricsIndex);
+    if (!fileName.empty()) {
+        std::ofstream metricsFile(fileName.c_str());
+        if (!metricsFile) {
+            throw Exception() << "Can't open metrics file" << fileName;
+        }
+
+        writeJson(metricsFile, metrics);
+    }
+}
@@ -1,14 +1,37 @@
 #pragma once
 
+#include <backgroundmerge.h>
+#include <bufferpool.h>
+#include <checkpoint.h>
 #include <chunker.h>
+#include <compressedarchive.h>
+#include <distribution.h>
+#include <keyprefix.h>
 #include <merger.h>
+#include <metrics.h>
+#include <mmapper.h>
+#include <noncopyable.h>
+#include <parallel.h>
+#include <paralleldecoder.h>
 #include <serializer.h>
+#include <shard.h>
+#include <sparseindex.h>
+#include <streamarchive.h>
 #include <threadpool.h>
 #include <queuechunker.h>
+#include <readahead.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
 #include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 enum SortEventType {
@@ -21,6 +44,73 @@ enum SortEventType {
     DoneMergingChunks
 };
 
+enum ChunkCompression {
+    NoChunkCompression,
+    LzChunkCompression
+};
+
+struct SortOptions {
+    SortOptions() :
+            metrics(0),
+            chunkCompression(NoChunkCompression),
+            memoryBudget(0),
+            mmapWindowSize(0),
+            parallelDecoding(true),
+            shardCount(0),
+            checkpoint(false),
+            removeChunks(false),
+            mergeReadAhead(0),
+            payloadArena(false),
+            hugePages(false),
+            headerOnlyScan(false),
+            sparseIndexStep(0),
+            residentRuns(1),
+            backgroundMergeFanIn(0),
+            distributionSort(false) {}
+
+    // Filled with pipeline statistics if not null
+    SortMetrics* metrics;
+    // Format of sorted chunk files, merge reads chunks in the same format
+    ChunkCompression chunkCompression;
+    // Bytes externalSort may use to sort whole input in memory without chunk files, 0 disables
+    uint64_t memoryBudget;
+    // Input and chunk files are mapped by windows of this size instead of whole, 0 maps whole files
+    uint64_t mmapWindowSize;
+    // Input records are decoded by all pool threads if entry type is splittable and file is mapped whole
+    bool parallelDecoding;
+    // Output is written to this number of files with disjoint key ranges (see shard.h), 0 or 1 writes one file
+    size_t shardCount;
+    // externalSort records finished chunks and shards in chunkDir/checkpoint.manifest and
+    // reuses them when it is restarted with the same input (see checkpoint.h)
+    bool checkpoint;
+    // Chunk files are deleted after merge, single output merge also frees read parts of chunks
+    // while it goes. Chunk files are read by windows then, mmapWindowSize or 16 MB.
+    bool removeChunks;
+    // Single output merge reads every chunk by blocks of this size in background (see readahead.h), 0 maps chunks
+    uint64_t mergeReadAhead;
+    // Chunk entries keep payloads in arena of chunk buffer which is freed at once when chunk is
+    // written (see arena.h), entry type must specialize ArenaPlacement. Payloads decoded in
+    // parallel are in arenas of decoded ranges which are freed with the last chunk using them.
+    bool payloadArena;
+    // Arena blocks are backed by huge pages
+    bool hugePages;
+    // createIndexes reads data entries by HeaderScan, so payload isn't copied. Key functions
+    // get entries without skipped part.
+    bool headerOnlyScan;
+    // Key and offset of every step-th entry of output file (or of every shard) are written to
+    // output.sidx (see sparseindex.h), 0 disables. Not written for standard output.
+    size_t sparseIndexStep;
+    // externalSort keeps this number of last chunks in memory and merges them with chunk files
+    // instead of writing them. Not used for sharded output and checkpointed sort.
+    size_t residentRuns;
+    // Written chunks are merged by this number in background while input is read (see
+    // backgroundmerge.h), 0 disables. Not used for sharded output and checkpointed sort.
+    size_t backgroundMergeFanIn;
+    // externalSort partitions input into buckets by key and sorts them one by one instead
+    // of merging chunks (see distribution.h). Not used for sharded output and checkpointed sort.
+    bool distributionSort;
+};
+
 namespace _Impl {
 
 struct DefaultEventCallback {
@@ -37,37 +127,334 @@ struct DefaultChunkerFunction {
 struct DefaultSortFunction {
     template <typename RandomAccessIterator>
     void operator()(RandomAccessIterator begin, RandomAccessIterator end) {
-        std::sort(begin, end);
+        typedef typename std::iterator_traits<RandomAccessIterator>::value_type T;
+
+        if (KeyPrefix<T>::enabled) {
+            sortByKeyPrefix(begin, end);
+        } else {
+            std::sort(begin, end);
+        }
+    }
+};
+
+// Serializes calls of user callback made from pool threads
+template <typename EventCallback>
+class SyncEventCallback {
+public:
+    explicit SyncEventCallback(EventCallback& callback) :
+            eventCallback(callback) {}
+
+    void operator()(SortEventType type, int param) {
+        std::unique_lock<std::mutex> lock(mutex);
+        eventCallback(type, param);
     }
+
+private:
+    EventCallback& eventCallback;
+    std::mutex mutex;
 };
 
+// Writes sorted entries, every sampler step entry is sampled with its offset
+template <typename EntryType, typename OutArchive>
+void writeSortedRun(const std::vector<EntryType>& entries, OutArchive& outArchive, const std::string& fileName,
+        RunSampler<EntryType>* sampler) {
+    const size_t step = sampler ? sampler->step(entries.size()) : 1;
+    const size_t firstSample = RunSampler<EntryType>::firstSample(step);
+    RunSamples<EntryType> samples(step);
+
+    if (IsBitwiseSerializable<EntryType>::value) {
+        // Offsets of samples are known without writing entries one by one
+        const uint64_t startPos = outArchive.pos();
+        for (size_t i = firstSample; sampler && i < entries.size(); i += step) {
+            samples.entries.push_back(entries[i]);
+            samples.offsets.push_back(startPos + i * sizeof(EntryType));
+        }
+
+        serializeArray(entries.data(), entries.size(), outArchive);
+    } else {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (sampler && i % step == firstSample) {
+                samples.entries.push_back(entries[i]);
+                samples.offsets.push_back(outArchive.pos());
+            }
+
+            serialize(entries[i], outArchive);
+        }
+    }
+    outArchive.flush();
+
+    if (sampler) {
+        sampler->addRun(fileName, std::move(samples));
+    }
+}
+
+// Writes sorted entries of output file, indexing them if sparse index is enabled
+template <typename EntryType, typename OutArchive>
+void writeSortedEntries(const EntryType* entries, size_t count, OutArchive& outArchive, SparseIndexWriter<EntryType>& sparseIndex) {
+    if (!sparseIndex.enabled()) {
+        serializeArray(entries, count, outArchive);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        sparseIndex.add(entries[i], outArchive.pos());
+        serialize(entries[i], outArchive);
+    }
+}
+
 template <typename InArchive, typename OutArchive, typename EntryType, typename SortFunction>
-void sortFileInMemory(const std::string& fileName, SortFunction sort) {
+void sortFileInMemory(const std::string& fileName, SortFunction sort, ChunkMetrics* chunk = 0,
+        RunSampler<EntryType>* sampler = 0) {
+    Stopwatch stopwatch;
+
     InArchive inArchive(fileName);
 
     std::vector<EntryType> dataVector;
 
-    while (!inArchive.eof()) {
-        EntryType entry;
-        deserialize(entry, inArchive);
+    if (IsBitwiseSerializable<EntryType>::value) {
+        // Files sorted here are uncompressed, so entry count is known from file size
+        uint64_t size = fileSize(fileName);
+        if (size % sizeof(EntryType)) {
+            throw Exception() << "Size of" << fileName << "isn't multiple of entry size";
+        }
 
-        dataVector.push_back(entry);
+        dataVector.resize(size / sizeof(EntryType));
+        deserializeArray(dataVector.data(), dataVector.size(), inArchive);
+    } else {
+        while (!inArchive.eof()) {
+            dataVector.push_back(EntryType());
+            deserialize(dataVector.back(), inArchive);
+        }
     }
 
+    double readTime = stopwatch.wallTime();
+    double readWaitTime = stopwatch.waitTime();
+    stopwatch.restart();
+
     sort(dataVector.begin(), dataVector.end());
 
+    double sortTime = stopwatch.wallTime();
+    stopwatch.restart();
+
     OutArchive outArchive(fileName);
-    std::for_each(dataVector.begin(), dataVector.end(), [&outArchive](const EntryType& entry) {
-        serialize(entry, outArchive);
-    });
+    writeSortedRun(dataVector, outArchive, fileName, sampler);
+
+    if (chunk) {
+        chunk->entries = dataVector.size();
+        chunk->bytes = fileSize(fileName);
+        chunk->readTime = readTime;
+        chunk->sortTime = sortTime;
+        chunk->writeTime = stopwatch.wallTime();
+        chunk->ioWaitTime = readWaitTime + stopwatch.waitTime();
+    }
+}
+
+// Fixed layout entries of uncompressed file are sorted in shared mapping of the file, so
+// they aren't decoded, copied and written back by archive. Kernel writes dirty pages.
+template <typename EntryType, typename SortFunction>
+void sortFileInPlace(const std::string& fileName, SortFunction sort, ChunkMetrics* chunk = 0,
+        RunSampler<EntryType>* sampler = 0) {
+    Stopwatch stopwatch;
+
+    SharedMemMapper mapper(fileName);
+    if (mapper.getSize() % sizeof(EntryType)) {
+        throw Exception() << "Size of" << fileName << "isn't multiple of entry size";
+    }
+
+    // Sort reads the whole chunk anyway
+    mapper.advise(MADV_WILLNEED);
+
+    EntryType* entries = reinterpret_cast<EntryType*>(mapper.getBeginPtr());
+    const size_t count = mapper.getSize() / sizeof(EntryType);
+
+    double mapTime = stopwatch.wallTime();
+    double mapWaitTime = stopwatch.waitTime();
+    stopwatch.restart();
+
+    sort(entries, entries + count);
+
+    double sortTime = stopwatch.wallTime();
+
+    if (sampler) {
+        const size_t step = sampler->step(count);
+        RunSamples<EntryType> samples(step);
+        for (size_t i = RunSampler<EntryType>::firstSample(step); i < count; i += step) {
+            samples.entries.push_back(entries[i]);
+            samples.offsets.push_back(i * sizeof(EntryType));
+        }
+
+        sampler->addRun(fileName, std::move(samples));
+    }
+
+    if (chunk) {
+        chunk->entries = count;
+        chunk->bytes = mapper.getSize();
+        chunk->readTime = mapTime;
+        chunk->sortTime = sortTime;
+        // Kernel writes dirty pages back
+        chunk->writeTime = 0;
+        chunk->ioWaitTime = mapWaitTime + stopwatch.waitTime();
+    }
+}
+
+// Sorts uncompressed file in place if entries have fixed layout
+template <typename EntryType, typename SortFunction>
+void sortFile(const std::string& fileName, SortFunction sort, ChunkCompression compression, ChunkMetrics* chunk = 0,
+        RunSampler<EntryType>* sampler = 0) {
+    if (compression == LzChunkCompression) {
+        sortFileInMemory<CopyableFileInArchive, CopyableCompressedFileOutArchive, EntryType>(fileName, sort, chunk, sampler);
+    } else if (IsBitwiseSerializable<EntryType>::value) {
+        sortFileInPlace<EntryType>(fileName, sort, chunk, sampler);
+    } else {
+        sortFileInMemory<CopyableFileInArchive, CopyableFileOutArchive, EntryType>(fileName, sort, chunk, sampler);
+    }
+}
+
+// Input size plus size of entry objects and of parallelSort merge buffer of them,
+// entry count is estimated by first entries
+template <typename EntryType>
+uint64_t estimateMemoryUsage(const std::string& fileName) {
+    const size_t SAMPLE_SIZE = 1 << 12;
+
+    FileInArchive inArchive(fileName);
+
+    size_t count = 0;
+    while (!inArchive.eof() && count < SAMPLE_SIZE) {
+        EntryType entry;
+        deserialize(entry, inArchive);
+        ++count;
+    }
+
+    if (!count) {
+        return 0;
+    }
+
+    uint64_t inputSize = fileSize(fileName);
+    uint64_t estimatedCount = inputSize / std::max<uint64_t>(inArchive.pos() / count, 1);
+
+    return inputSize + 2 * estimatedCount * sizeof(EntryType);
 }
 
 std::string getChunkFileName(const std::string& chunkDir, size_t chunkCounter) {
-    std::stringstream sstr;
-    sstr << chunkDir << "/chunk_" << chunkCounter << ".dat";
-    return sstr.str();
+    return stripedChunkFileName(chunkDir, "chunk_", chunkCounter);
+}
+
+// Calls function(EntryType&&, endPos), endPos is input offset of entry end
+template <typename EntryType, typename InArchive, typename Function>
+void forEachEntry(InArchive& inArchive, Function function) {
+    while (!inArchive.eof()) {
+        EntryType data;
+        deserialize(data, inArchive);
+
+        if (!isValid(data)) {
+            throw Exception() << "Read data is not valid";
+        }
+
+        function(std::move(data), inArchive.pos());
+    }
+}
+
+template <typename EntryType, typename Function>
+void forEachEntry(ParallelFileDecoder<EntryType>& decoder, Function function) {
+    decoder.forEach(function);
+}
+
+// Reads entries to buffer, calls function(endPos) after every entry. Function may replace buffer.
+// Payloads are read into arena of buffer if it has one.
+template <typename EntryType, typename InArchive, typename Function>
+void forEachEntry(InArchive& inArchive, std::unique_ptr< ChunkBuffer<EntryType> >& buffer, const DecodeArenas&,
+        Function function) {
+    while (!inArchive.eof()) {
+        if (!isValid(buffer->read(inArchive))) {
+            throw Exception() << "Read data is not valid";
+        }
+
+        function(inArchive.pos());
+    }
+}
+
+// Entries are decoded by pool threads to arenas of decoded ranges, buffer keeps arenas of its entries
+template <typename EntryType, typename Function>
+void forEachEntry(ParallelFileDecoder<EntryType>& decoder, std::unique_ptr< ChunkBuffer<EntryType> >& buffer,
+        const DecodeArenas& arenas, Function function) {
+    decoder.forEach(arenas, [&buffer, &function](EntryType&& data, uint64_t endPos, const std::shared_ptr<Arena>& arena) {
+        buffer->add(std::move(data), arena);
+        function(endPos);
+    });
+}
+
+template <typename EntryType>
+bool useParallelDecoding(const char* fileName, const ThreadPool& threadPool, const SortOptions& options) {
+    return RecordBoundary<EntryType>::splittable && options.parallelDecoding && !options.mmapWindowSize &&
+            threadPool.size() > 1 && !isStandardStream(fileName);
+}
+
+// Samples run of entryCount entries written before, like writeSortedRun does
+template <typename EntryType, typename InArchive>
+void sampleRun(const std::string& fileName, uint64_t entryCount, RunSampler<EntryType>& sampler) {
+    const size_t step = sampler.step(entryCount);
+    const size_t firstSample = RunSampler<EntryType>::firstSample(step);
+    RunSamples<EntryType> samples(step);
+
+    InArchive inArchive(fileName);
+    for (size_t i = 0; !inArchive.eof(); ++i) {
+        uint64_t pos = inArchive.pos();
+
+        EntryType entry;
+        deserialize(entry, inArchive);
+
+        if (i % step == firstSample) {
+            samples.entries.push_back(entry);
+            samples.offsets.push_back(pos);
+        }
+    }
+
+    sampler.addRun(fileName, std::move(samples));
 }
 
+// Sorts chunk files filled by Chunker in task group
+template <typename SortFunction, typename EventCallback>
+class ChunkFileSorter : Noncopyable {
+public:
+    ChunkFileSorter(TaskGroup& group, SortFunction sortFunction, ChunkCompression chunkCompression,
+            MetricsRecorder& metricsRecorder, SyncEventCallback<EventCallback>& callback) :
+            sortGroup(group),
+            sort(sortFunction),
+            compression(chunkCompression),
+            recorder(metricsRecorder),
+            syncCallback(callback),
+            chunkCounter(0) {}
+
+    template <typename EntryType>
+    void sortChunk(const std::string& fileName, RunSampler<EntryType>* sampler = 0) {
+        size_t chunkIndex = chunkCounter++;
+        Stopwatch queued;
+
+        SortFunction sort = this->sort;
+        ChunkCompression compression = this->compression;
+        MetricsRecorder& recorder = this->recorder;
+        SyncEventCallback<EventCallback>& syncCallback = this->syncCallback;
+
+        sortGroup.run([fileName, sort, chunkIndex, queued, compression, sampler, &recorder, &syncCallback]() {
+            ChunkMetrics chunk;
+            chunk.queueTime = queued.wallTime();
+
+            sortFile<EntryType>(fileName, sort, compression, &chunk, sampler);
+
+            recorder.addChunk(chunkIndex, chunk);
+            syncCallback(ChunkSorted, chunkIndex);
+        });
+    }
+
+private:
+    TaskGroup& sortGroup;
+    SortFunction sort;
+    const ChunkCompression compression;
+    MetricsRecorder& recorder;
+    SyncEventCallback<EventCallback>& syncCallback;
+    size_t chunkCounter;
+};
+
 }
 
 template <typename EntryType, typename ChunkerFunction = _Impl::DefaultChunkerFunction, typename EventCallback = _Impl::DefaultEventCallback>
@@ -123,22 +510,36 @@ void createSortedChunks(const std::string& fileName, const std::string& chunkDir
 template <typename EntryType, typename Chunker = Chunker<EntryType>, typename ChunkerFunction = _Impl::DefaultChunkerFunction,
         typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
 void createAndSortChunks(const char* dataFileName, const char* chunkDir, std::list<std::string>& chunkFiles,
-        size_t itemsInChunk, size_t threadCount, ChunkerFunction chunkerFunction = _Impl::DefaultChunkerFunction(),
-        SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback()) {
-    eventCallback(BeginCreatingChunks, 0);
+        size_t itemsInChunk, ThreadPool& threadPool, ChunkerFunction chunkerFunction = _Impl::DefaultChunkerFunction(),
+        SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    typedef typename Chunker::EntryType ChunkEntryType;
 
-    ThreadPool threadPool(threadCount);
+    _Impl::MetricsRecorder recorder(options.metrics);
+    _Impl::PhaseTimer phaseTimer(recorder, &SortMetrics::createChunks);
+    _Impl::SyncEventCallback<EventCallback> syncCallback(eventCallback);
+
+    syncCallback(BeginCreatingChunks, 0);
+    syncCallback(BeginSortingChunks, 0);
+
+    TaskGroup sortGroup(threadPool);
+
+    _Impl::ChunkFileSorter<SortFunction, EventCallback> chunkSorter(sortGroup, sort, options.chunkCompression, recorder, syncCallback);
+    auto sortChunk = [&chunkSorter](const std::string& fileName) {
+        chunkSorter.template sortChunk<ChunkEntryType>(fileName);
+    };
 
     Chunker chunker(chunkDir, itemsInChunk,
             [&](const char* chunkFileName) -> void {
-                threadPool.schedule([=]() {
-                    _Impl::sortFileInMemory<CopyableFileInArchive, CopyableFileOutArchive, typename Chunker::EntryType>(chunkFileName, sort);
-                });
+                sortChunk(chunkFileName);
             }
     );
 
-    FileInArchive inArchive(dataFileName);
+    _Impl::Stopwatch readStopwatch;
 
+    FileInArchive inArchive(dataFileName, options.mmapWindowSize);
+
+    uint64_t recordsRead = 0;
     while (!inArchive.eof()) {
         EntryType data;
         deserialize(data, inArchive);
@@ -148,160 +549,1302 @@ void createAndSortChunks(const char* dataFileName, const char* chunkDir, std::li
         }
 
         chunkerFunction(data, chunker, inArchive);
+        ++recordsRead;
     }
 
     chunkFiles = chunker.getChunkFileNames();
 
     chunker.flush();
 
-    std::string chunkFileName = chunkFiles.back();
-    threadPool.schedule([&chunkFileName, &sort]() {
-        _Impl::sortFileInMemory<CopyableFileInArchive, CopyableFileOutArchive, typename Chunker::EntryType>(chunkFileName, sort);
+    recorder.addIoWait(readStopwatch.waitTime());
+
+    sortChunk(chunkFiles.back());
+
+    _Impl::Stopwatch waitStopwatch;
+    sortGroup.wait();
+    recorder.addQueueWait(waitStopwatch.wallTime());
+
+    recorder.update([&inArchive, recordsRead](SortMetrics& m) {
+        m.recordsRead += recordsRead;
+        m.bytesRead += inArchive.pos();
     });
 
-    threadPool.waitTasksAndExit();
+    syncCallback(EndSortingChunks, 0);
 
-    eventCallback(DoneCreatingChunks, chunkFiles.size());
+    phaseTimer.stop();
+
+    syncCallback(DoneCreatingChunks, chunkFiles.size());
 }
 
-template <typename T, typename Sort>
-struct SortFunctor {
-    SortFunctor(std::vector<T>&& d, Sort s, const std::string& fName) :
-            data(std::move(d)),
-            sort(s),
-            fileName(fName){}
+template <typename EntryType, typename Chunker = Chunker<EntryType>, typename ChunkerFunction = _Impl::DefaultChunkerFunction,
+        typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void createAndSortChunks(const char* dataFileName, const char* chunkDir, std::list<std::string>& chunkFiles,
+        size_t itemsInChunk, size_t threadCount, ChunkerFunction chunkerFunction = _Impl::DefaultChunkerFunction(),
+        SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    ThreadPool threadPool(threadCount);
 
-    SortFunctor(const SortFunctor& other) {
-        data = other.data;
-        sort = other.sort;
-        fileName = other.fileName;
-    }
+    createAndSortChunks<EntryType, Chunker>(dataFileName, chunkDir, chunkFiles, itemsInChunk, threadPool,
+            chunkerFunction, sort, eventCallback, options);
+}
 
-    SortFunctor& operator = (const SortFunctor& other) {
-        SortFunctor tmp(other);
-        std::swap(other, *this);
-        return *this;
-    }
+template <typename T, typename Sort, typename OutArchive = FileOutArchive>
+struct SortFunctor {
+    typedef typename ChunkBufferPool<T>::BufferPtr BufferPtr;
 
-    SortFunctor(SortFunctor&& other) {
-        data = std::move(other.data);
-        sort = std::move(other.sort);
-        fileName = std::move(other.fileName);
+    SortFunctor(std::vector<T>&& d, Sort s, const std::string& fName,
+            std::function<void(const ChunkMetrics&)> done = std::function<void(const ChunkMetrics&)>(),
+            RunSampler<T>* smplr = 0, bool chunkChecksum = false) :
+            buffer(new ChunkBuffer<T>(0)),
+            pool(0),
+            sort(s),
+            fileName(fName),
+            chunkDone(done),
+            sampler(smplr),
+            withChecksum(chunkChecksum) {
+        buffer->entries = std::move(d);
     }
 
-    SortFunctor& operator = (SortFunctor&& other) {
-        data = std::move(other.data);
-        sort = std::move(other.sort);
-        fileName = std::move(other.fileName);
-        return *this;
-    }
+    // Buffer is returned to pool when chunk is written. With chunkChecksum chunk metrics
+    // passed to chunkDone get checksum of the written file.
+    SortFunctor(BufferPtr&& buf, ChunkBufferPool<T>& bufferPool, Sort s, const std::string& fName,
+            std::function<void(const ChunkMetrics&)> done = std::function<void(const ChunkMetrics&)>(),
+            RunSampler<T>* smplr = 0, bool chunkChecksum = false) :
+            buffer(std::move(buf)),
+            pool(&bufferPool),
+            sort(s),
+            fileName(fName),
+            chunkDone(done),
+            sampler(smplr),
+            withChecksum(chunkChecksum) {}
 
     void operator()() {
-        std::sort(data.begin(), data.end());
+        std::vector<T>& data = buffer->entries;
+
+        ChunkMetrics chunk;
+        chunk.queueTime = queued.wallTime();
+        chunk.entries = data.size();
+
+        _Impl::Stopwatch stopwatch;
+
+        sort(data.begin(), data.end());
+
+        chunk.sortTime = stopwatch.wallTime();
+        stopwatch.restart();
+
+        OutArchive outArchive(fileName);
+        if (withChecksum) {
+            outArchive.enableChecksum();
+        }
+        _Impl::writeSortedRun(data, outArchive, fileName, sampler);
+
+        chunk.bytes = fileSize(fileName);
+        if (withChecksum) {
+            chunk.checksum = outArchive.checksum();
+        }
+        chunk.writeTime = stopwatch.wallTime();
+        chunk.ioWaitTime = stopwatch.waitTime();
 
-        FileOutArchive outArchive(fileName);
-        for (const T& value : data) {
-            serialize(value, outArchive);
+        if (pool) {
+            pool->release(std::move(buffer));
+        } else {
+            buffer.reset();
+        }
+
+        if (chunkDone) {
+            chunkDone(chunk);
         }
     }
 
-    std::vector<T> data;
+    BufferPtr buffer;
+    ChunkBufferPool<T>* pool;
     Sort sort;
     std::string fileName;
+    std::function<void(const ChunkMetrics&)> chunkDone;
+    RunSampler<T>* sampler;
+    bool withChecksum;
+    _Impl::Stopwatch queued;
 };
 
-template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
-void createAndSortChunksInPlace(const char* dataFileName, const char* chunkDir, std::list<std::string>& chunkFiles,
-        size_t itemsInChunk, size_t threadCount, SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback()) {
-    eventCallback(BeginCreatingChunks, 0);
+// Sorted chunks kept in memory instead of chunk files, merged directly with chunk files
+template <typename EntryType>
+struct ResidentRuns : Noncopyable {
+    std::list<typename ChunkBufferPool<EntryType>::BufferPtr> buffers;
+};
 
-    ThreadPool threadPool(threadCount);
+namespace _Impl {
 
-    FileInArchive inArchive(dataFileName);
+template <typename EntryType, typename InArchive, typename SortFunction, typename EventCallback>
+void createAndSortChunksInPlace(InArchive& inArchive, const char* chunkDir, std::list<std::string>& chunkFiles,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort, EventCallback& eventCallback, const SortOptions& options,
+        RunSampler<EntryType>* sampler, SortCheckpoint* checkpoint, ResidentRuns<EntryType>* residentRuns) {
+    typedef typename ChunkBufferPool<EntryType>::BufferPtr BufferPtr;
 
-    std::vector<EntryType> entries;
+    MetricsRecorder recorder(options.metrics);
+    PhaseTimer phaseTimer(recorder, &SortMetrics::createChunks);
+    SyncEventCallback<EventCallback> syncCallback(eventCallback);
+
+    syncCallback(BeginCreatingChunks, 0);
+    syncCallback(BeginSortingChunks, 0);
+
+    // Declared before task group, sort tasks return buffers to it
+    ChunkBufferPool<EntryType> bufferPool(threadPool.size() + 1, options.payloadArena, options.hugePages);
+
+    // Samples and checkpoint refer to chunks as they are written
+    std::unique_ptr< BackgroundMerger<EntryType> > backgroundMerger;
+    if (options.backgroundMergeFanIn > 1 && !sampler && !checkpoint) {
+        backgroundMerger.reset(new BackgroundMerger<EntryType>(chunkDir, options.backgroundMergeFanIn,
+                options.chunkCompression == LzChunkCompression, options.mmapWindowSize, threadPool, recorder));
+    }
+
+    // Declared after background merger, it is stopped after sort tasks are done
+    TaskGroup sortGroup(threadPool);
 
     size_t chunkCounter = 0;
+    uint64_t resumeOffset = 0;
 
-    size_t count = 0;
-    while (!inArchive.eof()) {
-        EntryType data;
-        deserialize(data, inArchive);
+    if (checkpoint) {
+        for (const CheckpointChunk& chunk : checkpoint->completedChunks()) {
+            chunkFiles.push_back(chunk.fileName);
+            ++chunkCounter;
 
-        if (!isValid(data)) {
-            throw Exception() << "Read data is not valid";
+            if (sampler && options.chunkCompression == LzChunkCompression) {
+                sampleRun<EntryType, CompressedFileInArchive>(chunk.fileName, chunk.entries, *sampler);
+            } else if (sampler) {
+                sampleRun<EntryType, FileInArchive>(chunk.fileName, chunk.entries, *sampler);
+            }
         }
 
-        entries.push_back(data);
+        resumeOffset = checkpoint->resumeOffset();
+        inArchive.skip(resumeOffset);
+    }
 
-        if (count++ > itemsInChunk) {
-            std::string chunkFileName = _Impl::getChunkFileName(chunkDir, chunkCounter++);
-            chunkFiles.push_back(chunkFileName);
-            SortFunctor<EntryType, SortFunction> sortFunction(std::move(entries), sort, chunkFileName);
+    auto sortChunk = [&](BufferPtr&& buffer, uint64_t inputBegin, uint64_t inputEnd) {
+        size_t chunkIndex = chunkCounter++;
+        std::string chunkFileName = getChunkFileName(chunkDir, chunkIndex);
+        chunkFiles.push_back(chunkFileName);
+
+        BackgroundMerger<EntryType>* merger = backgroundMerger.get();
+        std::function<void(const ChunkMetrics&)> chunkDone = [chunkIndex, chunkFileName, inputBegin, inputEnd, checkpoint,
+                merger, &recorder, &syncCallback](const ChunkMetrics& chunk) {
+            if (checkpoint) {
+                CheckpointChunk done;
+                done.index = chunkIndex;
+                done.inputBegin = inputBegin;
+                done.inputEnd = inputEnd;
+                done.entries = chunk.entries;
+                done.bytes = chunk.bytes;
+                done.checksum = chunk.checksum;
+                done.fileName = chunkFileName;
+                checkpoint->chunkDone(done);
+            }
+
+            recorder.addChunk(chunkIndex, chunk);
+            syncCallback(ChunkSorted, chunkIndex);
+
+            if (merger) {
+                merger->chunkWritten(chunkFileName);
+            }
+        };
+
+        if (options.chunkCompression == LzChunkCompression) {
+            sortGroup.run(SortFunctor<EntryType, SortFunction, CompressedFileOutArchive>(std::move(buffer), bufferPool, sort,
+                    chunkFileName, chunkDone, sampler, checkpoint != 0));
+        } else {
+            sortGroup.run(SortFunctor<EntryType, SortFunction>(std::move(buffer), bufferPool, sort, chunkFileName, chunkDone,
+                    sampler, checkpoint != 0));
+        }
+    };
+
+    // Last full chunks wait here, so the ones left at the end of input are kept in memory
+    struct PendingChunk {
+        BufferPtr buffer;
+        uint64_t inputBegin;
+        uint64_t inputEnd;
+    };
+
+    const size_t maxResident = residentRuns ? options.residentRuns : 0;
+    std::list<PendingChunk> pendingChunks;
+
+    auto addChunk = [&](BufferPtr&& buffer, uint64_t inputBegin, uint64_t inputEnd) {
+        if (!maxResident) {
+            sortChunk(std::move(buffer), inputBegin, inputEnd);
+            return;
+        }
+
+        pendingChunks.push_back(PendingChunk{std::move(buffer), inputBegin, inputEnd});
+        if (pendingChunks.size() > maxResident) {
+            PendingChunk& chunk = pendingChunks.front();
+            sortChunk(std::move(chunk.buffer), chunk.inputBegin, chunk.inputEnd);
+            pendingChunks.pop_front();
+        }
+    };
 
-            std::vector<EntryType>().swap(entries);
+    Stopwatch readStopwatch;
 
-            threadPool.schedule(sortFunction);
+    BufferPtr buffer = bufferPool.acquire();
+
+    uint64_t recordsRead = 0;
+    size_t count = 0;
+    uint64_t chunkBegin = resumeOffset;
+    uint64_t chunkEnd = resumeOffset;
+    const DecodeArenas decodeArenas(options.payloadArena && ArenaPlacement<EntryType>::enabled, options.hugePages);
+    forEachEntry<EntryType>(inArchive, buffer, decodeArenas, [&](uint64_t endPos) {
+        ++recordsRead;
+        chunkEnd = endPos;
+
+        if (count++ > itemsInChunk) {
+            addChunk(std::move(buffer), chunkBegin, chunkEnd);
+
+            buffer = bufferPool.acquire();
 
             count = 0;
+            chunkBegin = chunkEnd;
         }
+    });
+
+    // Resumed sort may have whole input in reused chunks
+    if (!buffer->entries.empty() || (!chunkCounter && pendingChunks.empty())) {
+        addChunk(std::move(buffer), chunkBegin, chunkEnd);
     }
 
-    std::string chunkFileName = _Impl::getChunkFileName(chunkDir, chunkCounter++);
-    chunkFiles.push_back(chunkFileName);
+    recorder.addIoWait(readStopwatch.waitTime());
 
-    SortFunctor<EntryType, SortFunction> sortFunction(std::move(entries), sort, chunkFileName);
-    threadPool.schedule(sortFunction);
+    for (PendingChunk& chunk : pendingChunks) {
+        residentRuns->buffers.push_back(std::move(chunk.buffer));
 
-    threadPool.waitTasksAndExit();
+        std::vector<EntryType>& entries = residentRuns->buffers.back()->entries;
+        size_t chunkIndex = chunkCounter++;
+        Stopwatch queued;
 
-    eventCallback(DoneCreatingChunks, chunkFiles.size());
+        sortGroup.run([&entries, sort, chunkIndex, queued, &recorder, &syncCallback]() mutable {
+            ChunkMetrics chunk;
+            chunk.queueTime = queued.wallTime();
+            chunk.entries = entries.size();
+
+            Stopwatch stopwatch;
+            sort(entries.begin(), entries.end());
+            chunk.sortTime = stopwatch.wallTime();
+
+            recorder.addChunk(chunkIndex, chunk);
+            syncCallback(ChunkSorted, chunkIndex);
+        });
+    }
+
+    Stopwatch waitStopwatch;
+    sortGroup.wait();
+    recorder.addQueueWait(waitStopwatch.wallTime());
+
+    if (backgroundMerger) {
+        chunkFiles = backgroundMerger->finish();
+    }
+
+    recorder.update([&inArchive, recordsRead, resumeOffset](SortMetrics& m) {
+        m.recordsRead += recordsRead;
+        m.bytesRead += inArchive.pos() - resumeOffset;
+    });
+
+    syncCallback(EndSortingChunks, 0);
+
+    phaseTimer.stop();
+
+    syncCallback(DoneCreatingChunks, chunkCounter);
+}
+
+}
+
+// Data file name "-" means standard input. Sorted chunks are sampled to sampler if it is given.
+// Chunks completed before are reused and finished chunks are recorded if checkpoint is given.
+// If residentRuns is given, SortOptions::residentRuns last chunks are sorted into it and aren't written.
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void createAndSortChunksInPlace(const char* dataFileName, const char* chunkDir, std::list<std::string>& chunkFiles,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions(), RunSampler<EntryType>* sampler = 0, SortCheckpoint* checkpoint = 0,
+        ResidentRuns<EntryType>* residentRuns = 0) {
+    if (isStandardStream(dataFileName)) {
+        if (checkpoint) {
+            throw Exception() << "Sort of standard input can't be checkpointed";
+        }
+
+        StreamInArchive inArchive(dataFileName);
+        _Impl::createAndSortChunksInPlace<EntryType>(inArchive, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback, options,
+                sampler, checkpoint, residentRuns);
+    } else if (_Impl::useParallelDecoding<EntryType>(dataFileName, threadPool, options)) {
+        ParallelFileDecoder<EntryType> decoder(dataFileName, threadPool);
+        _Impl::createAndSortChunksInPlace<EntryType>(decoder, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback, options,
+                sampler, checkpoint, residentRuns);
+    } else {
+        FileInArchive inArchive(dataFileName, options.mmapWindowSize);
+        _Impl::createAndSortChunksInPlace<EntryType>(inArchive, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback, options,
+                sampler, checkpoint, residentRuns);
+    }
+}
+
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void createAndSortChunksInPlace(const char* dataFileName, const char* chunkDir, std::list<std::string>& chunkFiles,
+        size_t itemsInChunk, size_t threadCount, SortFunction sort = SortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    ThreadPool threadPool(threadCount);
+
+    createAndSortChunksInPlace<EntryType>(dataFileName, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback, options);
 }
 
 template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction,
         typename EventCallback = _Impl::DefaultEventCallback>
-void sortChunks(const std::list<std::string>& chunkFiles, size_t threadCount,
-        SortFunction sort = _Impl::DefaultSortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback()) {
-    eventCallback(BeginSortingChunks, 0);
+void sortChunks(const std::list<std::string>& chunkFiles, ThreadPool& threadPool,
+        SortFunction sort = _Impl::DefaultSortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    _Impl::MetricsRecorder recorder(options.metrics);
+    _Impl::PhaseTimer phaseTimer(recorder, &SortMetrics::sortChunks);
+    _Impl::SyncEventCallback<EventCallback> syncCallback(eventCallback);
 
-    ThreadPool threadPool(threadCount);
+    syncCallback(BeginSortingChunks, 0);
+
+    TaskGroup sortGroup(threadPool);
+
+    const ChunkCompression compression = options.chunkCompression;
 
+    size_t chunkIndex = 0;
     std::list<std::string>::const_iterator fileNameIt = chunkFiles.begin();
-    for (; fileNameIt != chunkFiles.end(); ++fileNameIt) {
-        threadPool.schedule([=]() {
-            _Impl::sortFileInMemory<CopyableFileInArchive, CopyableFileOutArchive, EntryType>(*fileNameIt, sort);
+    for (; fileNameIt != chunkFiles.end(); ++fileNameIt, ++chunkIndex) {
+        std::string fileName = *fileNameIt;
+        _Impl::Stopwatch queued;
+
+        sortGroup.run([fileName, sort, chunkIndex, queued, compression, &recorder, &syncCallback]() {
+            ChunkMetrics chunk;
+            chunk.queueTime = queued.wallTime();
+
+            _Impl::sortFile<EntryType>(fileName, sort, compression, &chunk);
+
+            recorder.addChunk(chunkIndex, chunk);
+            syncCallback(ChunkSorted, chunkIndex);
         });
     }
 
-    threadPool.waitTasksAndExit();
+    sortGroup.wait();
+
+    phaseTimer.stop();
+
+    syncCallback(EndSortingChunks, 0);
 }
 
-template <typename EntryType, typename EventCallback = _Impl::DefaultEventCallback>
-void mergeChunks(const std::list<std::string>& chunkFiles, const char* outputFileName, EventCallback eventCallback = _Impl::DefaultEventCallback()) {
-    eventCallback(BeginMergingChunks, 0);
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction,
+        typename EventCallback = _Impl::DefaultEventCallback>
+void sortChunks(const std::list<std::string>& chunkFiles, size_t threadCount,
+        SortFunction sort = _Impl::DefaultSortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    ThreadPool threadPool(threadCount);
 
-    std::list<CopyableFileInArchive> archives;
+    sortChunks<EntryType>(chunkFiles, threadPool, sort, eventCallback, options);
+}
 
-    std::list<std::string>::const_iterator fileNameIt = chunkFiles.begin();
-    for (; fileNameIt != chunkFiles.end(); ++fileNameIt) {
-        archives.push_back(CopyableFileInArchive(*fileNameIt));
-    }
+namespace _Impl {
+
+enum {
+    RELEASE_WINDOW_SIZE = 1 << 24
+};
+
+// Window size for reading chunks in merge
+inline uint64_t chunkWindowSize(const SortOptions& options) {
+    return options.removeChunks && !options.mmapWindowSize ? RELEASE_WINDOW_SIZE : options.mmapWindowSize;
+}
+
+template <typename EntryType, typename InArchive>
+void mergeSources(const std::list<InArchive>& archives, const std::list<std::string>& chunkFiles, const char* outputFileName,
+        size_t sparseIndexStep, MetricsRecorder& recorder) {
+    Stopwatch stopwatch;
+
+    uint64_t recordsWritten = 0;
+
+    SparseIndexWriter<EntryType> sparseIndex(outputFileName, isStandardStream(outputFileName) ? 0 : sparseIndexStep);
 
-    Merger<EntryType, CopyableFileInArchive> merger(archives);
-    FileOutArchive outArchive(outputFileName);
-    merger.merge([&outArchive](const EntryType& entry) -> void {
+    Merger<EntryType, InArchive> merger(archives);
+    StreamOutArchive outArchive(outputFileName);
+    merger.merge([&outArchive, &recordsWritten, &sparseIndex](const EntryType& entry) -> void {
+        sparseIndex.add(entry, outArchive.pos());
         serialize(entry, outArchive);
+        ++recordsWritten;
     });
+    outArchive.flush();
 
-    eventCallback(DoneMergingChunks, 0);
+    sparseIndex.write(outArchive.pos());
+
+    recorder.update([&](SortMetrics& m) {
+        for (const std::string& fileName : chunkFiles) {
+            m.chunkBytesRead += fileSize(fileName);
+        }
+
+        m.recordsWritten += recordsWritten;
+        m.bytesWritten += outArchive.pos();
+        m.ioWaitTime += stopwatch.waitTime();
+    });
 }
 
-template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
-void externalSort(const char* fileName, const char* chunkDir, const char* outputFileName,
-        size_t itemsInChunk, size_t threadCount, SortFunction sort = _Impl::DefaultSortFunction(),
-        EventCallback eventCallback = _Impl::DefaultEventCallback()) {
-    std::list<std::string> chunkFiles;
+// Resident runs are merged together with chunk archives
+template <typename EntryType, typename InArchive>
+void mergeRuns(std::list<InArchive>& archives, ResidentRuns<EntryType>* residentRuns, const std::list<std::string>& chunkFiles,
+        const char* outputFileName, size_t sparseIndexStep, MetricsRecorder& recorder) {
+    if (!residentRuns || residentRuns->buffers.empty()) {
+        mergeSources<EntryType>(archives, chunkFiles, outputFileName, sparseIndexStep, recorder);
+        return;
+    }
+
+    std::list< MergeRun<EntryType, InArchive> > runs;
+
+    typename std::list<InArchive>::iterator archIt = archives.begin();
+    for (; archIt != archives.end(); ++archIt) {
+        runs.push_back(MergeRun<EntryType, InArchive>(*archIt));
+    }
+
+    for (const typename ChunkBufferPool<EntryType>::BufferPtr& buffer : residentRuns->buffers) {
+        runs.push_back(MergeRun<EntryType, InArchive>(buffer->entries));
+    }
+
+    mergeSources<EntryType>(runs, chunkFiles, outputFileName, sparseIndexStep, recorder);
+
+    recorder.update([residentRuns](SortMetrics& m) {
+        m.residentRuns += residentRuns->buffers.size();
+    });
+
+    residentRuns->buffers.clear();
+}
+
+template <typename EntryType, typename InArchive>
+void mergeChunkArchives(const std::list<std::string>& chunkFiles, ResidentRuns<EntryType>* residentRuns,
+        const char* outputFileName, uint64_t windowSize, bool releaseRead, size_t sparseIndexStep, MetricsRecorder& recorder) {
+    std::list<InArchive> archives;
+
+    std::list<std::string>::const_iterator fileNameIt = chunkFiles.begin();
+    for (; fileNameIt != chunkFiles.end(); ++fileNameIt) {
+        archives.push_back(InArchive(*fileNameIt, windowSize, releaseRead));
+    }
+
+    mergeRuns<EntryType>(archives, residentRuns, chunkFiles, outputFileName, sparseIndexStep, recorder);
+}
+
+// Every chunk is read by blocks ahead of merge by read(2) or, if compressed, by windows of mapping
+template <typename EntryType, typename InArchive, typename... Args>
+void mergeChunksReadAhead(const std::list<std::string>& chunkFiles, ResidentRuns<EntryType>* residentRuns,
+        const char* outputFileName, uint64_t blockSize, size_t sparseIndexStep, MetricsRecorder& recorder, Args... args) {
+    typedef ReadAheadScheduler<EntryType, InArchive> Scheduler;
+
+    Scheduler scheduler(blockSize);
+
+    std::list<typename Scheduler::Run> runs;
+
+    std::list<std::string>::const_iterator fileNameIt = chunkFiles.begin();
+    for (; fileNameIt != chunkFiles.end(); ++fileNameIt) {
+        runs.push_back(scheduler.addRun(*fileNameIt, args...));
+    }
+
+    mergeRuns<EntryType>(runs, residentRuns, chunkFiles, outputFileName, sparseIndexStep, recorder);
+}
+
+template <typename EntryType>
+void mergeChunkFiles(const std::list<std::string>& chunkFiles, const char* outputFileName, const SortOptions& options,
+        MetricsRecorder& recorder, ResidentRuns<EntryType>* residentRuns = 0) {
+    const uint64_t windowSize = chunkWindowSize(options);
+
+    if (options.mergeReadAhead && options.chunkCompression == LzChunkCompression) {
+        mergeChunksReadAhead<EntryType, CompressedFileInArchive>(chunkFiles, residentRuns, outputFileName, options.mergeReadAhead,
+                options.sparseIndexStep, recorder, std::max<uint64_t>(windowSize, options.mergeReadAhead), options.removeChunks);
+    } else if (options.mergeReadAhead) {
+        mergeChunksReadAhead<EntryType, StreamInArchive>(chunkFiles, residentRuns, outputFileName, options.mergeReadAhead,
+                options.sparseIndexStep, recorder, static_cast<size_t>(options.mergeReadAhead));
+    } else if (options.chunkCompression == LzChunkCompression) {
+        mergeChunkArchives<EntryType, CopyableCompressedFileInArchive>(chunkFiles, residentRuns, outputFileName, windowSize,
+                options.removeChunks, options.sparseIndexStep, recorder);
+    } else {
+        mergeChunkArchives<EntryType, CopyableFileInArchive>(chunkFiles, residentRuns, outputFileName, windowSize,
+                options.removeChunks, options.sparseIndexStep, recorder);
+    }
+
+    if (options.removeChunks) {
+        removeChunkFiles(chunkFiles);
+    }
+}
+
+}
+
+// Output file name "-" means standard output. Resident runs are merged with chunk files and released.
+template <typename EntryType, typename EventCallback = _Impl::DefaultEventCallback>
+void mergeChunks(const std::list<std::string>& chunkFiles, const char* outputFileName, EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions(), ResidentRuns<EntryType>* residentRuns = 0) {
+    _Impl::MetricsRecorder recorder(options.metrics);
+    _Impl::PhaseTimer phaseTimer(recorder, &SortMetrics::mergeChunks);
+
+    eventCallback(BeginMergingChunks, 0);
+
+    _Impl::mergeChunkFiles<EntryType>(chunkFiles, outputFileName, options, recorder, residentRuns);
+
+    phaseTimer.stop();
+
+    eventCallback(DoneMergingChunks, 0);
+}
+
+namespace _Impl {
+
+// Offset of the first entry of sorted run which isn't less than value
+template <typename EntryType, typename InArchive>
+uint64_t runLowerBound(const std::string& fileName, const RunSamples<EntryType>& samples, const EntryType& value,
+        uint64_t windowSize) {
+    size_t sample = std::lower_bound(samples.entries.begin(), samples.entries.end(), value) - samples.entries.begin();
+
+    // Entries before the first sample may be less than value too
+    InArchive inArchive(fileName, windowSize);
+    if (sample) {
+        inArchive.skip(samples.offsets[sample - 1]);
+    }
+
+    while (!inArchive.eof()) {
+        uint64_t pos = inArchive.pos();
+
+        EntryType entry;
+        deserialize(entry, inArchive);
+
+        if (!(entry < value)) {
+            return pos;
+        }
+    }
+
+    return inArchive.pos();
+}
+
+// Merges part of every run in [lower, upper) range, null bound means no bound
+template <typename EntryType, typename InArchive>
+void mergeShard(const std::list<std::string>& chunkFiles, const RunSampler<EntryType>& sampler,
+        const EntryType* lower, const EntryType* upper, uint64_t windowSize, size_t sparseIndexStep, ShardInfo& shard,
+        MetricsRecorder& recorder) {
+    typedef RangeInArchive<InArchive> ShardInArchive;
+
+    Stopwatch stopwatch;
+
+    std::list<ShardInArchive> archives;
+
+    std::list<std::string>::const_iterator fileNameIt = chunkFiles.begin();
+    for (; fileNameIt != chunkFiles.end(); ++fileNameIt) {
+        const RunSamples<EntryType>& samples = sampler.run(*fileNameIt);
+
+        uint64_t begin = lower ? runLowerBound<EntryType, InArchive>(*fileNameIt, samples, *lower, windowSize) : 0;
+        uint64_t end = upper ? runLowerBound<EntryType, InArchive>(*fileNameIt, samples, *upper, windowSize) :
+                std::numeric_limits<uint64_t>::max();
+
+        archives.push_back(ShardInArchive(InArchive(*fileNameIt, windowSize), begin, end));
+    }
+
+    EntryType lastEntry;
+
+    SparseIndexWriter<EntryType> sparseIndex(shard.fileName, sparseIndexStep);
+
+    Merger<EntryType, ShardInArchive> merger(archives);
+    StreamOutArchive outArchive(shard.fileName);
+    merger.merge([&](const EntryType& entry) -> void {
+        if (!shard.entries) {
+            shard.firstKey = KeyString<EntryType>::get(entry);
+        }
+
+        sparseIndex.add(entry, outArchive.pos());
+        serialize(entry, outArchive);
+        lastEntry = entry;
+        ++shard.entries;
+    });
+    outArchive.flush();
+
+    sparseIndex.write(outArchive.pos());
+
+    if (shard.entries) {
+        shard.lastKey = KeyString<EntryType>::get(lastEntry);
+    }
+    shard.bytes = outArchive.pos();
+
+    recorder.update([&](SortMetrics& m) {
+        m.recordsWritten += shard.entries;
+        m.bytesWritten += shard.bytes;
+        m.ioWaitTime += stopwatch.waitTime();
+    });
+}
+
+// Shards recorded in checkpoint are kept
+template <typename EntryType>
+void mergeChunkFilesToShards(const std::list<std::string>& chunkFiles, const RunSampler<EntryType>& sampler,
+        const char* outputFileName, ThreadPool& threadPool, const SortOptions& options, MetricsRecorder& recorder,
+        SortCheckpoint* checkpoint = 0) {
+    if (isStandardStream(outputFileName)) {
+        throw Exception() << "Sharded output can't be written to standard output";
+    }
+
+    const size_t shardCount = options.shardCount;
+    const std::vector<EntryType> splitters = sampler.splitters(shardCount);
+
+    std::vector<ShardInfo> shards(shardCount);
+
+    parallelFor(threadPool, 0, shardCount, [&](size_t index) {
+        ShardInfo& shard = shards[index];
+        shard.fileName = shardFileName(outputFileName, index);
+
+        if (checkpoint && checkpoint->shardDone(shardCount, index, shard.fileName, shard)) {
+            return;
+        }
+
+        // No samples means no entries, all shards are empty
+        if (index > splitters.size()) {
+            StreamOutArchive outArchive(shard.fileName);
+            SparseIndexWriter<EntryType>(shard.fileName, options.sparseIndexStep).write(0);
+            return;
+        }
+
+        const EntryType* lower = index ? &splitters[index - 1] : 0;
+        const EntryType* upper = index < splitters.size() ? &splitters[index] : 0;
+
+        if (options.chunkCompression == LzChunkCompression) {
+            mergeShard<EntryType, CopyableCompressedFileInArchive>(chunkFiles, sampler, lower, upper, options.mmapWindowSize,
+                    options.sparseIndexStep, shard, recorder);
+        } else {
+            mergeShard<EntryType, CopyableFileInArchive>(chunkFiles, sampler, lower, upper, options.mmapWindowSize,
+                    options.sparseIndexStep, shard, recorder);
+        }
+
+        if (checkpoint) {
+            checkpoint->setShardDone(shardCount, index, shard);
+        }
+    });
+
+    recorder.update([&chunkFiles](SortMetrics& m) {
+        for (const std::string& fileName : chunkFiles) {
+            m.chunkBytesRead += fileSize(fileName);
+        }
+    });
+
+    writeShardManifest(outputFileName, shards);
+
+    // Shards read ranges of the same chunks concurrently, so chunks are removed only at the end
+    if (options.removeChunks) {
+        removeChunkFiles(chunkFiles);
+    }
+}
+
+// Splits sorted entries to shards of equal size, equal entries stay in one shard
+template <typename EntryType>
+uint64_t writeShards(const std::vector<EntryType>& entries, const char* outputFileName, size_t shardCount,
+        size_t sparseIndexStep, ThreadPool& threadPool) {
+    if (isStandardStream(outputFileName)) {
+        throw Exception() << "Sharded output can't be written to standard output";
+    }
+
+    std::vector<size_t> bounds(shardCount + 1, entries.size());
+    bounds[0] = 0;
+    for (size_t shard = 1; shard < shardCount; ++shard) {
+        size_t bound = std::max(entries.size() * shard / shardCount, bounds[shard - 1]);
+        while (bound > 0 && bound < entries.size() && !(entries[bound - 1] < entries[bound])) {
+            ++bound;
+        }
+
+        bounds[shard] = bound;
+    }
+
+    std::vector<ShardInfo> shards(shardCount);
+
+    parallelFor(threadPool, 0, shardCount, [&](size_t index) {
+        ShardInfo& shard = shards[index];
+        shard.fileName = shardFileName(outputFileName, index);
+        shard.entries = bounds[index + 1] - bounds[index];
+
+        if (shard.entries) {
+            shard.firstKey = KeyString<EntryType>::get(entries[bounds[index]]);
+            shard.lastKey = KeyString<EntryType>::get(entries[bounds[index + 1] - 1]);
+        }
+
+        SparseIndexWriter<EntryType> sparseIndex(shard.fileName, sparseIndexStep);
+
+        StreamOutArchive outArchive(shard.fileName);
+        writeSortedEntries(entries.data() + bounds[index], shard.entries, outArchive, sparseIndex);
+        outArchive.flush();
+
+        shard.bytes = outArchive.pos();
+        sparseIndex.write(shard.bytes);
+    });
+
+    writeShardManifest(outputFileName, shards);
+
+    uint64_t bytesWritten = 0;
+    for (const ShardInfo& shard : shards) {
+        bytesWritten += shard.bytes;
+    }
+
+    return bytesWritten;
+}
+
+}
+
+// Merges sorted chunks to options.shardCount files with disjoint key ranges, shard N is
+// written to outputFileName.N. Splitters and bounds of shards in every chunk are found
+// with samples taken when chunks were written. Shards are merged concurrently.
+template <typename EntryType, typename EventCallback = _Impl::DefaultEventCallback>
+void mergeChunksToShards(const std::list<std::string>& chunkFiles, const RunSampler<EntryType>& sampler,
+        const char* outputFileName, ThreadPool& threadPool, EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions(), SortCheckpoint* checkpoint = 0) {
+    _Impl::MetricsRecorder recorder(options.metrics);
+    _Impl::PhaseTimer phaseTimer(recorder, &SortMetrics::mergeChunks);
+
+    eventCallback(BeginMergingChunks, 0);
+
+    _Impl::mergeChunkFilesToShards<EntryType>(chunkFiles, sampler, outputFileName, threadPool, options, recorder, checkpoint);
+
+    phaseTimer.stop();
+
+    eventCallback(DoneMergingChunks, 0);
+}
+
+namespace _Impl {
+
+template <typename EntryType, typename InArchive, typename SortFunction, typename EventCallback>
+void sortInMemory(InArchive& inArchive, const char* outputFileName, ThreadPool& threadPool,
+        SortFunction sort, EventCallback& eventCallback, const SortOptions& options) {
+    MetricsRecorder recorder(options.metrics);
+    PhaseTimer phaseTimer(recorder, &SortMetrics::sortChunks);
+
+    eventCallback(BeginSortingChunks, 0);
+
+    Stopwatch stopwatch;
+
+    std::vector<EntryType> entries;
+
+    forEachEntry<EntryType>(inArchive, [&entries](EntryType&& data, uint64_t) {
+        entries.push_back(std::move(data));
+    });
+
+    double readWaitTime = stopwatch.waitTime();
+
+    parallelSort(threadPool, entries.begin(), entries.end(), sort);
+
+    stopwatch.restart();
+
+    uint64_t bytesWritten = 0;
+    if (options.shardCount > 1) {
+        bytesWritten = writeShards(entries, outputFileName, options.shardCount, options.sparseIndexStep, threadPool);
+    } else {
+        SparseIndexWriter<EntryType> sparseIndex(outputFileName, isStandardStream(outputFileName) ? 0 : options.sparseIndexStep);
+
+        StreamOutArchive outArchive(outputFileName);
+        writeSortedEntries(entries.data(), entries.size(), outArchive, sparseIndex);
+        outArchive.flush();
+
+        bytesWritten = outArchive.pos();
+        sparseIndex.write(bytesWritten);
+    }
+
+    recorder.update([&](SortMetrics& m) {
+        m.inMemorySort = true;
+        m.recordsRead += entries.size();
+        m.bytesRead += inArchive.pos();
+        m.recordsWritten += entries.size();
+        m.bytesWritten += bytesWritten;
+        m.ioWaitTime += readWaitTime + stopwatch.waitTime();
+    });
+
+    phaseTimer.stop();
+
+    eventCallback(EndSortingChunks, 0);
+}
+
+}
+
+// Sorts whole file in memory using all pool threads and writes output without chunk files.
+// File name "-" means standard input or output.
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void sortInMemory(const char* fileName, const char* outputFileName, ThreadPool& threadPool,
+        SortFunction sort = _Impl::DefaultSortFunction(), EventCallback eventCallback = _Impl::DefaultEventCallback(),
+        const SortOptions& options = SortOptions()) {
+    if (isStandardStream(fileName)) {
+        StreamInArchive inArchive(fileName);
+        _Impl::sortInMemory<EntryType>(inArchive, outputFileName, threadPool, sort, eventCallback, options);
+    } else if (_Impl::useParallelDecoding<EntryType>(fileName, threadPool, options)) {
+        ParallelFileDecoder<EntryType> decoder(fileName, threadPool);
+        _Impl::sortInMemory<EntryType>(decoder, outputFileName, threadPool, sort, eventCallback, options);
+    } else {
+        FileInArchive inArchive(fileName, options.mmapWindowSize);
+        _Impl::sortInMemory<EntryType>(inArchive, outputFileName, threadPool, sort, eventCallback, options);
+    }
+}
+
+namespace _Impl {
+
+// Types of temporary files written with given compression
+template <ChunkCompression compression>
+struct ChunkArchives {
+    typedef FileOutArchive OutArchive;
+    typedef FileInArchive InArchive;
+    typedef CopyableFileInArchive CopyableInArchive;
+};
+
+template <>
+struct ChunkArchives<LzChunkCompression> {
+    typedef CompressedFileOutArchive OutArchive;
+    typedef CompressedFileInArchive InArchive;
+    typedef CopyableCompressedFileInArchive CopyableInArchive;
+};
+
+enum {
+    // Bucket of more than this number of chunks is partitioned again
+    MAX_BUCKET_CHUNKS = 2,
+    // Bucket files of one partition are written at once, so their number is bounded
+    MAX_BUCKETS = 256
+};
+
+// Sorts bucket which can't be split by chunks and writes their merge to output
+template <typename EntryType, typename Archives, typename SortFunction, typename WriteFunction>
+void sortLargeBucket(const std::string& bucketFileName, const char* chunkDir, size_t itemsInChunk, ThreadPool& threadPool,
+        SortFunction sort, const SortOptions& options, WriteFunction write) {
+    SortOptions chunkOptions;
+    chunkOptions.chunkCompression = options.chunkCompression;
+    chunkOptions.payloadArena = options.payloadArena;
+    chunkOptions.hugePages = options.hugePages;
+
+    DefaultEventCallback eventCallback;
+    std::list<std::string> chunkFiles;
+
+    try {
+        {
+            typename Archives::InArchive inArchive(bucketFileName);
+            createAndSortChunksInPlace<EntryType>(inArchive, chunkDir, chunkFiles, itemsInChunk, threadPool, sort,
+                    eventCallback, chunkOptions, static_cast<RunSampler<EntryType>*>(0), 0,
+                    static_cast<ResidentRuns<EntryType>*>(0));
+        }
+
+        std::list<typename Archives::CopyableInArchive> archives;
+        for (const std::string& fileName : chunkFiles) {
+            archives.push_back(typename Archives::CopyableInArchive(fileName));
+        }
+
+        Merger<EntryType, typename Archives::CopyableInArchive> merger(archives);
+        merger.merge(write);
+    } catch (...) {
+        removeChunkFiles(chunkFiles);
+        throw;
+    }
+
+    removeChunkFiles(chunkFiles);
+}
+
+// Bucket files of partition in key order
+struct BucketFiles {
+    std::vector<std::string> fileNames;
+    std::vector<uint64_t> entries;
+};
+
+// Partitions input into bucket files and writes sorted buckets in order. Bucket larger
+// than a few chunks is partitioned again. Bucket files left are removed by destructor,
+// e.g. if sort fails.
+template <typename EntryType, typename Archives, typename SortFunction>
+class BucketSorter : Noncopyable {
+public:
+    typedef typename Archives::OutArchive BucketOutArchive;
+    typedef typename Archives::InArchive BucketInArchive;
+    typedef std::unique_ptr< std::vector<EntryType> > BucketPtr;
+
+    BucketSorter(const char* dir, size_t itemsInChunk, ThreadPool& pool, SortFunction sortFunction,
+            const SortOptions& sortOptions) :
+            chunkDir(dir),
+            countInChunk(std::max<size_t>(itemsInChunk, 1)),
+            threadPool(pool),
+            sort(sortFunction),
+            options(sortOptions),
+            bucketBytes(0) {}
+
+    ~BucketSorter() {
+        for (const std::string& fileName : bucketFiles) {
+            std::remove(fileName.c_str());
+        }
+    }
+
+    // Splitters are taken from sample of the first entries of input, input shorter than
+    // sample is left in sample. Bucket count is estimated from inputSize if it is known.
+    template <typename InArchive>
+    void split(InArchive& inArchive, uint64_t inputSize, std::vector<EntryType>& sample, BucketFiles& partition) {
+        std::unique_ptr< BucketSplitters<EntryType> > splitters;
+        std::vector< std::unique_ptr<BucketOutArchive> > buckets;
+
+        forEachEntry<EntryType>(inArchive, [&](EntryType&& data, uint64_t endPos) {
+            if (splitters) {
+                addToBucket(data, *splitters, buckets, partition);
+                return;
+            }
+
+            sample.push_back(std::move(data));
+            if (sample.size() < countInChunk) {
+                return;
+            }
+
+            // Size of stream input is unknown
+            size_t bucketCount = std::min<size_t>(4 * threadPool.size(), MAX_BUCKETS);
+            if (inputSize) {
+                bucketCount = bucketsOf(inputSize / std::max<uint64_t>(endPos / sample.size(), 1));
+            }
+
+            parallelSort(threadPool, sample.begin(), sample.end(), sort);
+            splitters.reset(new BucketSplitters<EntryType>(sample, bucketCount));
+            createBuckets(*splitters, buckets, partition);
+
+            for (const EntryType& entry : sample) {
+                addToBucket(entry, *splitters, buckets, partition);
+            }
+
+            std::vector<EntryType>().swap(sample);
+        });
+
+        closeBuckets(buckets, partition);
+    }
+
+    // Buckets are sorted by pool threads in order, a few ahead of the one being written.
+    // Large bucket of more than splitLimit entries isn't partitioned again, it is sorted by
+    // chunks: evenly sampled bucket stays that large only if it has many equal keys.
+    template <typename OutArchive>
+    void write(const BucketFiles& partition, uint64_t splitLimit, OutArchive& outArchive,
+            SparseIndexWriter<EntryType>& sparseIndex) {
+        struct SortedBucket {
+            size_t bucket;
+            std::future<BucketPtr> entries;
+        };
+
+        std::deque<SortedBucket> sortedBuckets;
+        size_t nextBucket = 0;
+
+        auto scheduleBuckets = [&]() {
+            while (nextBucket < partition.fileNames.size() && sortedBuckets.size() <= threadPool.size()) {
+                SortedBucket sorted;
+                sorted.bucket = nextBucket;
+
+                const uint64_t count = partition.entries[nextBucket];
+                if (count <= MAX_BUCKET_CHUNKS * countInChunk) {
+                    std::string fileName = partition.fileNames[nextBucket];
+                    SortFunction bucketSort = sort;
+                    sorted.entries = threadPool.schedule([fileName, count, bucketSort]() mutable -> BucketPtr {
+                        BucketPtr entries(new std::vector<EntryType>(count));
+                        {
+                            BucketInArchive bucketArchive(fileName);
+                            deserializeArray(entries->data(), count, bucketArchive);
+                        }
+
+                        std::remove(fileName.c_str());
+
+                        bucketSort(entries->begin(), entries->end());
+                        return entries;
+                    });
+                }
+
+                sortedBuckets.push_back(std::move(sorted));
+                ++nextBucket;
+            }
+        };
+
+        try {
+            scheduleBuckets();
+
+            while (!sortedBuckets.empty()) {
+                SortedBucket& sorted = sortedBuckets.front();
+                const std::string& fileName = partition.fileNames[sorted.bucket];
+
+                if (sorted.entries.valid()) {
+                    // Writer helps to sort buckets while it waits
+                    while (sorted.entries.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        if (!threadPool.runPendingTask()) {
+                            sorted.entries.wait();
+                        }
+                    }
+
+                    BucketPtr entries = sorted.entries.get();
+                    writeSortedEntries(entries->data(), entries->size(), outArchive, sparseIndex);
+                } else if (partition.entries[sorted.bucket] <= splitLimit) {
+                    writeLargeBucket(fileName, partition.entries[sorted.bucket], outArchive, sparseIndex);
+                } else {
+                    sortLargeBucket<EntryType, Archives>(fileName, chunkDir.c_str(), countInChunk, threadPool, sort, options,
+                            [&outArchive, &sparseIndex](const EntryType& entry) {
+                                sparseIndex.add(entry, outArchive.pos());
+                                serialize(entry, outArchive);
+                            });
+                    std::remove(fileName.c_str());
+                }
+
+                sortedBuckets.pop_front();
+                scheduleBuckets();
+            }
+        } catch (...) {
+            // Bucket files are removed when sort tasks are done with them
+            for (SortedBucket& sorted : sortedBuckets) {
+                if (sorted.entries.valid()) {
+                    sorted.entries.wait();
+                }
+            }
+
+            throw;
+        }
+    }
+
+    size_t bucketCount() const {
+        return bucketFiles.size();
+    }
+
+    uint64_t bytesWritten() const {
+        return bucketBytes;
+    }
+
+private:
+    // Bucket is about a chunk
+    size_t bucketsOf(uint64_t entries) const {
+        return std::min<uint64_t>(std::max<uint64_t>((entries + countInChunk - 1) / countInChunk, 2), MAX_BUCKETS);
+    }
+
+    void createBuckets(const BucketSplitters<EntryType>& splitters, std::vector< std::unique_ptr<BucketOutArchive> >& buckets,
+            BucketFiles& partition) {
+        for (size_t bucket = 0; bucket < splitters.bucketCount(); ++bucket) {
+            std::string fileName = bucketFileName(chunkDir, bucketFiles.size());
+            bucketFiles.push_back(fileName);
+            buckets.emplace_back(new BucketOutArchive(fileName));
+            partition.fileNames.push_back(fileName);
+        }
+
+        partition.entries.assign(buckets.size(), 0);
+    }
+
+    static void addToBucket(const EntryType& entry, const BucketSplitters<EntryType>& splitters,
+            std::vector< std::unique_ptr<BucketOutArchive> >& buckets, BucketFiles& partition) {
+        size_t bucket = splitters.bucket(entry);
+        serialize(entry, *buckets[bucket]);
+        ++partition.entries[bucket];
+    }
+
+    void closeBuckets(std::vector< std::unique_ptr<BucketOutArchive> >& buckets, BucketFiles& partition) {
+        for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+            buckets[bucket]->flush();
+            buckets[bucket].reset();
+            bucketBytes += fileSize(partition.fileNames[bucket]);
+        }
+    }
+
+    // Entries of large bucket are already known to be in one key range, so its first chunk
+    // isn't a fair sample, sample is taken evenly from the whole bucket by extra pass
+    template <typename OutArchive>
+    void writeLargeBucket(const std::string& fileName, uint64_t count, OutArchive& outArchive,
+            SparseIndexWriter<EntryType>& sparseIndex) {
+        const size_t bucketCount = bucketsOf(count);
+        const uint64_t step = std::max<uint64_t>(count / countInChunk, 1);
+
+        std::vector<EntryType> sample;
+        {
+            BucketInArchive bucketArchive(fileName);
+            for (uint64_t i = 0; !bucketArchive.eof(); ++i) {
+                EntryType entry;
+                deserialize(entry, bucketArchive);
+
+                if (i % step == step / 2) {
+                    sample.push_back(std::move(entry));
+                }
+            }
+        }
+
+        parallelSort(threadPool, sample.begin(), sample.end(), sort);
+        BucketSplitters<EntryType> splitters(sample, bucketCount);
+        std::vector<EntryType>().swap(sample);
+
+        BucketFiles subPartition;
+        {
+            std::vector< std::unique_ptr<BucketOutArchive> > buckets;
+            createBuckets(splitters, buckets, subPartition);
+
+            BucketInArchive bucketArchive(fileName);
+            while (!bucketArchive.eof()) {
+                EntryType entry;
+                deserialize(entry, bucketArchive);
+                addToBucket(entry, splitters, buckets, subPartition);
+            }
+
+            closeBuckets(buckets, subPartition);
+        }
+
+        std::remove(fileName.c_str());
+
+        write(subPartition, count / 2, outArchive, sparseIndex);
+    }
+
+private:
+    const std::string chunkDir;
+    const size_t countInChunk;
+    ThreadPool& threadPool;
+    SortFunction sort;
+    const SortOptions& options;
+    // Files of all partitions, removed ones too
+    std::vector<std::string> bucketFiles;
+    uint64_t bucketBytes;
+};
+
+template <typename EntryType, typename Archives, typename InArchive, typename SortFunction, typename EventCallback>
+void distributionSort(InArchive& inArchive, uint64_t inputSize, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort, EventCallback& eventCallback, const SortOptions& options) {
+    MetricsRecorder recorder(options.metrics);
+    PhaseTimer partitionTimer(recorder, &SortMetrics::createChunks);
+
+    eventCallback(BeginCreatingChunks, 0);
+
+    Stopwatch stopwatch;
+
+    BucketSorter<EntryType, Archives, SortFunction> bucketSorter(chunkDir, itemsInChunk, threadPool, sort, options);
+
+    // Beginning of input is the sample, then it is partitioned like the rest
+    std::vector<EntryType> sample;
+    BucketFiles partition;
+    bucketSorter.split(inArchive, inputSize, sample, partition);
+
+    uint64_t recordsRead = sample.size();
+    for (uint64_t count : partition.entries) {
+        recordsRead += count;
+    }
+
+    const double readWaitTime = stopwatch.waitTime();
+
+    recorder.update([&](SortMetrics& m) {
+        m.recordsRead += recordsRead;
+        m.bytesRead += inArchive.pos();
+    });
+
+    partitionTimer.stop();
+
+    eventCallback(DoneCreatingChunks, partition.fileNames.size());
+    eventCallback(BeginMergingChunks, 0);
+
+    PhaseTimer writeTimer(recorder, &SortMetrics::mergeChunks);
+    stopwatch.restart();
+
+    SparseIndexWriter<EntryType> sparseIndex(outputFileName, isStandardStream(outputFileName) ? 0 : options.sparseIndexStep);
+    StreamOutArchive outArchive(outputFileName);
+
+    // Whole input is the sample
+    if (!sample.empty()) {
+        parallelSort(threadPool, sample.begin(), sample.end(), sort);
+        writeSortedEntries(sample.data(), sample.size(), outArchive, sparseIndex);
+    }
+
+    // Splitters of the first chunk may put most of input to one bucket, e.g. of sorted input
+    bucketSorter.write(partition, std::numeric_limits<uint64_t>::max(), outArchive, sparseIndex);
+
+    outArchive.flush();
+    sparseIndex.write(outArchive.pos());
+
+    recorder.update([&](SortMetrics& m) {
+        m.distributionBuckets += bucketSorter.bucketCount();
+        m.chunkBytesWritten += bucketSorter.bytesWritten();
+        m.chunkBytesRead += bucketSorter.bytesWritten();
+        m.recordsWritten += recordsRead;
+        m.bytesWritten += outArchive.pos();
+        m.ioWaitTime += readWaitTime + stopwatch.waitTime();
+    });
+
+    writeTimer.stop();
+
+    eventCallback(DoneMergingChunks, 0);
+}
+
+template <typename EntryType, typename InArchive, typename SortFunction, typename EventCallback>
+void distributionSort(InArchive& inArchive, uint64_t inputSize, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort, EventCallback& eventCallback, const SortOptions& options) {
+    if (options.chunkCompression == LzChunkCompression) {
+        distributionSort<EntryType, ChunkArchives<LzChunkCompression> >(inArchive, inputSize, chunkDir, outputFileName,
+                itemsInChunk, threadPool, sort, eventCallback, options);
+    } else {
+        distributionSort<EntryType, ChunkArchives<NoChunkCompression> >(inArchive, inputSize, chunkDir, outputFileName,
+                itemsInChunk, threadPool, sort, eventCallback, options);
+    }
+}
+
+}
+
+// Partitions input into bucket files by splitters taken from the first itemsInChunk entries,
+// sorts every bucket in memory and writes buckets in order, without merge. Suits keys whose
+// distribution in the beginning of input is like in the whole input. Bucket larger than a few
+// chunks is partitioned again by splitters of an even sample over the whole bucket, taken by
+// extra pass; sub-bucket which still holds more than half of it (equal keys) is sorted by
+// chunks and merged. Input and output file name "-" means standard input and output.
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void distributionSort(const char* fileName, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort = _Impl::DefaultSortFunction(),
+        EventCallback eventCallback = _Impl::DefaultEventCallback(), const SortOptions& options = SortOptions()) {
+    if (isStandardStream(fileName)) {
+        StreamInArchive inArchive(fileName);
+        _Impl::distributionSort<EntryType>(inArchive, 0, chunkDir, outputFileName, itemsInChunk, threadPool, sort, eventCallback,
+                options);
+    } else if (_Impl::useParallelDecoding<EntryType>(fileName, threadPool, options)) {
+        ParallelFileDecoder<EntryType> decoder(fileName, threadPool);
+        _Impl::distributionSort<EntryType>(decoder, fileSize(fileName), chunkDir, outputFileName, itemsInChunk, threadPool, sort,
+                eventCallback, options);
+    } else {
+        FileInArchive inArchive(fileName, options.mmapWindowSize);
+        _Impl::distributionSort<EntryType>(inArchive, fileSize(fileName), chunkDir, outputFileName, itemsInChunk, threadPool, sort,
+                eventCallback, options);
+    }
+}
+
+// Input and output file name "-" means standard input and output. Checkpointed sort
+// needs input and output files.
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void externalSort(const char* fileName, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, ThreadPool& threadPool, SortFunction sort = _Impl::DefaultSortFunction(),
+        EventCallback eventCallback = _Impl::DefaultEventCallback(), const SortOptions& options = SortOptions()) {
+    if (options.shardCount > 1 && isStandardStream(outputFileName)) {
+        throw Exception() << "Sharded output can't be written to standard output";
+    }
+
+    if (options.checkpoint && (isStandardStream(fileName) || isStandardStream(outputFileName))) {
+        throw Exception() << "Sort of standard streams can't be checkpointed";
+    }
+
+    // Size of stream input is unknown, so it is always sorted with chunks
+    if (options.memoryBudget && !isStandardStream(fileName) &&
+            _Impl::estimateMemoryUsage<EntryType>(fileName) <= options.memoryBudget) {
+        sortInMemory<EntryType>(fileName, outputFileName, threadPool, sort, eventCallback, options);
+        return;
+    }
+
+    if (options.distributionSort && options.shardCount <= 1 && !options.checkpoint) {
+        distributionSort<EntryType>(fileName, chunkDir, outputFileName, itemsInChunk, threadPool, sort, eventCallback, options);
+        return;
+    }
+
+    std::unique_ptr<SortCheckpoint> checkpoint;
+    if (options.checkpoint) {
+        checkpoint.reset(new SortCheckpoint(chunkDir, fileName, itemsInChunk, options.chunkCompression));
+
+        // Output is complete, chunks may be removed already
+        if (options.shardCount > 1 ? checkpoint->shardsDone(options.shardCount, outputFileName) :
+                checkpoint->mergeDone(outputFileName)) {
+            return;
+        }
+    }
+
+    std::list<std::string> chunkFiles;
+
+    if (options.shardCount > 1) {
+        RunSampler<EntryType> sampler;
+        createAndSortChunksInPlace<EntryType>(fileName, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback,
+                options, &sampler, checkpoint.get());
+        mergeChunksToShards<EntryType>(chunkFiles, sampler, outputFileName, threadPool, eventCallback, options, checkpoint.get());
+        return;
+    }
+
+    // Chunks of checkpointed sort must be in files to be reused
+    ResidentRuns<EntryType> residentRuns;
+    createAndSortChunksInPlace<EntryType>(fileName, chunkDir, chunkFiles, itemsInChunk, threadPool, sort, eventCallback, options,
+            0, checkpoint.get(), checkpoint ? 0 : &residentRuns);
+    mergeChunks<EntryType>(chunkFiles, outputFileName, eventCallback, options, &residentRuns);
+
+    if (checkpoint) {
+        checkpoint->setMerged(outputFileName, fileSize(outputFileName));
+    }
+}
+
+template <typename EntryType, typename SortFunction = _Impl::DefaultSortFunction, typename EventCallback = _Impl::DefaultEventCallback>
+void externalSort(const char* fileName, const char* chunkDir, const char* outputFileName,
+        size_t itemsInChunk, size_t threadCount, SortFunction sort = _Impl::DefaultSortFunction(),
+        EventCallback eventCallback = _Impl::DefaultEventCallback(), const SortOptions& options = SortOptions()) {
+    ThreadPool threadPool(threadCount);
 
-    createAndSortChunksInPlace<EntryType>(fileName, chunkDir, chunkFiles, itemsInChunk, threadCount, sort, eventCallback);
-    mergeChunks<EntryType>(chunkFiles, outputFileName, eventCallback);
+    externalSort<EntryType>(fileName, chunkDir, outputFileName, itemsInChunk, threadPool, sort, eventCallback, options);
 }
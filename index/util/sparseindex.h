@@ -0,0 +1,160 @@
+#pragma once
+
+#include <exception.h>
+#include <filearchive.h>
+#include <keytraits.h>
+#include <noncopyable.h>
+#include <serializer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sparse index of sorted file of variable length entries: key of every step-th entry
+// with its offset, kept in file name.sidx. Lookup starts scan of sorted file at the last
+// indexed entry less than the key, ranges between indexed entries can be read in parallel.
+
+inline std::string sparseIndexFileName(const std::string& fileName) {
+    return fileName + ".sidx";
+}
+
+namespace _Impl {
+
+enum {
+    // "SPARSIDX"
+    SPARSE_INDEX_MAGIC = 0x5844495353524150ULL
+};
+
+}
+
+template <typename EntryType>
+class SparseIndexWriter : Noncopyable {
+public:
+    typedef typename SparseIndexKey<EntryType>::KeyType KeyType;
+
+    // Step 0 disables index
+    SparseIndexWriter(const std::string& sortedFileName, size_t indexStep) :
+            fileName(sparseIndexFileName(sortedFileName)),
+            step(indexStep),
+            entryCount(0) {}
+
+    bool enabled() const {
+        return step != 0;
+    }
+
+    // Called for every entry in order, offset is entry start in sorted file
+    void add(const EntryType& entry, uint64_t offset) {
+        if (step && entryCount % step == 0) {
+            keys.push_back(SparseIndexKey<EntryType>::get(entry));
+            offsets.push_back(offset);
+        }
+
+        ++entryCount;
+    }
+
+    void write(uint64_t sortedFileSize) {
+        if (!step) {
+            return;
+        }
+
+        FileOutArchive outArchive(fileName);
+
+        const uint64_t header[] = {_Impl::SPARSE_INDEX_MAGIC, step, entryCount, keys.size(), sortedFileSize};
+        outArchive.write(header, sizeof(header) / sizeof(header[0]));
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            serialize(keys[i], outArchive);
+            outArchive.write(offsets[i]);
+        }
+
+        outArchive.flush();
+    }
+
+private:
+    const std::string fileName;
+    const uint64_t step;
+    uint64_t entryCount;
+    std::vector<KeyType> keys;
+    std::vector<uint64_t> offsets;
+};
+
+template <typename EntryType>
+class SparseIndex {
+public:
+    typedef typename SparseIndexKey<EntryType>::KeyType KeyType;
+
+    // Loads index of sorted file
+    explicit SparseIndex(const std::string& sortedFileName) {
+        std::string fileName = sparseIndexFileName(sortedFileName);
+        FileInArchive inArchive(fileName);
+
+        uint64_t header[5];
+        inArchive.read(header, 5);
+        if (header[0] != _Impl::SPARSE_INDEX_MAGIC) {
+            throw Exception() << fileName << "isn't sparse index";
+        }
+
+        indexStep = header[1];
+        entries = header[2];
+        sortedSize = header[4];
+
+        keys.resize(header[3]);
+        offsets.resize(header[3]);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            deserialize(keys[i], inArchive);
+            inArchive.read(offsets[i]);
+        }
+    }
+
+    // Offset to scan from for the first entry which key isn't less than key
+    uint64_t lowerBoundOffset(const KeyType& key) const {
+        size_t index = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        return index ? offsets[index - 1] : 0;
+    }
+
+    // Bounds of at most parts ranges of sorted file, every range starts at entry start
+    std::vector<uint64_t> split(size_t parts) const {
+        std::vector<uint64_t> bounds(1, 0);
+
+        for (size_t part = 1; part < parts; ++part) {
+            uint64_t offset = offsets.empty() ? 0 : offsets[offsets.size() * part / parts];
+            if (offset > bounds.back()) {
+                bounds.push_back(offset);
+            }
+        }
+
+        if (sortedSize > bounds.back()) {
+            bounds.push_back(sortedSize);
+        }
+
+        return bounds;
+    }
+
+    uint64_t step() const {
+        return indexStep;
+    }
+
+    uint64_t entryCount() const {
+        return entries;
+    }
+
+    uint64_t sortedFileSize() const {
+        return sortedSize;
+    }
+
+    const std::vector<KeyType>& indexedKeys() const {
+        return keys;
+    }
+
+    const std::vector<uint64_t>& indexedOffsets() const {
+        return offsets;
+    }
+
+private:
+    uint64_t indexStep;
+    uint64_t entries;
+    uint64_t sortedSize;
+    std::vector<KeyType> keys;
+    std::vector<uint64_t> offsets;
+};
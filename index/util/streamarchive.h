@@ -0,0 +1,280 @@
+#pragma once
+
+#include <exception.h>
+#include <noncopyable.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// "-" file name means standard input or output
+inline bool isStandardStream(const std::string& fileName) {
+    return fileName == "-";
+}
+
+// Reads file descriptor sequentially with large buffered reads, works with pipes.
+// Buffer is refilled as soon as it is consumed, so it is empty only at the end of
+// stream and eof doesn't read.
+class StreamInArchive : Noncopyable {
+public:
+    enum {
+        DEFAULT_BUFFER_SIZE = 1 << 22
+    };
+
+    explicit StreamInArchive(int fileFd, size_t bufferSize = DEFAULT_BUFFER_SIZE) :
+            fd(fileFd),
+            ownFd(false),
+            buffer(bufferSize),
+            bufferPos(0),
+            bufferEnd(0),
+            bufferStartPos(0),
+            streamEnd(false) {
+        fill();
+    }
+
+    explicit StreamInArchive(const std::string& fName, size_t bufferSize = DEFAULT_BUFFER_SIZE) :
+            fd(STDIN_FILENO),
+            ownFd(false),
+            fileName(fName),
+            buffer(bufferSize),
+            bufferPos(0),
+            bufferEnd(0),
+            bufferStartPos(0),
+            streamEnd(false) {
+        if (!isStandardStream(fileName)) {
+            fd = open(fileName.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw Exception() << "Can't open file" << fileName << strerror(errno);
+            }
+
+            ownFd = true;
+        }
+
+        try {
+            fill();
+        } catch (...) {
+            if (ownFd) {
+                close(fd);
+            }
+
+            throw;
+        }
+    }
+
+    ~StreamInArchive() {
+        if (ownFd) {
+            close(fd);
+        }
+    }
+
+    template <typename T>
+    bool read(T& entry, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        return read(&entry, 1);
+    }
+
+    template <typename T>
+    bool read(T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        if (eof()) {
+            return false;
+        }
+
+        char* data = reinterpret_cast<char*>(ptr);
+        size_t size = sizeof(T) * count;
+
+        while (size) {
+            if (eof()) {
+                throw Exception() << "Can't read" << size << "bytes from" << fileName << "because stream is ended";
+            }
+
+            size_t chunkSize = std::min(size, bufferEnd - bufferPos);
+            memcpy(data, &buffer[bufferPos], chunkSize);
+            bufferPos += chunkSize;
+            data += chunkSize;
+            size -= chunkSize;
+
+            refill();
+        }
+
+        return true;
+    }
+
+    bool eof() const {
+        return bufferPos == bufferEnd;
+    }
+
+    uint64_t pos() const {
+        return bufferStartPos + bufferPos;
+    }
+
+    void skip(uint64_t bytes) {
+        while (bytes) {
+            if (eof()) {
+                throw Exception() << "Can't skip" << bytes << "bytes in" << fileName << "because stream is ended";
+            }
+
+            size_t chunkSize = std::min<uint64_t>(bytes, bufferEnd - bufferPos);
+            bufferPos += chunkSize;
+            bytes -= chunkSize;
+
+            refill();
+        }
+    }
+
+private:
+    void refill() {
+        if (bufferPos == bufferEnd) {
+            fill();
+        }
+    }
+
+    // Reads next portion of stream into empty buffer
+    bool fill() {
+        if (streamEnd) {
+            return false;
+        }
+
+        bufferStartPos += bufferEnd;
+        bufferPos = 0;
+        bufferEnd = 0;
+
+        while (true) {
+            ssize_t count = ::read(fd, &buffer[0], buffer.size());
+
+            if (count > 0) {
+                bufferEnd = count;
+                return true;
+            }
+
+            if (count == 0) {
+                streamEnd = true;
+                return false;
+            }
+
+            if (errno != EINTR) {
+                throw Exception() << "Can't read" << fileName << strerror(errno);
+            }
+        }
+    }
+
+private:
+    int fd;
+    bool ownFd;
+    std::string fileName;
+    std::vector<char> buffer;
+    size_t bufferPos;
+    size_t bufferEnd;
+    uint64_t bufferStartPos;
+    bool streamEnd;
+};
+
+// Writes file descriptor with large buffered writes, works with pipes
+class StreamOutArchive : Noncopyable {
+public:
+    enum {
+        DEFAULT_BUFFER_SIZE = 1 << 22
+    };
+
+    explicit StreamOutArchive(int fileFd, size_t bufferSize = DEFAULT_BUFFER_SIZE) :
+            fd(fileFd),
+            ownFd(false),
+            bufferCapacity(bufferSize),
+            flushedPos(0) {
+        buffer.reserve(bufferCapacity);
+    }
+
+    explicit StreamOutArchive(const std::string& fName, size_t bufferSize = DEFAULT_BUFFER_SIZE) :
+            fd(STDOUT_FILENO),
+            ownFd(false),
+            fileName(fName),
+            bufferCapacity(bufferSize),
+            flushedPos(0) {
+        if (!isStandardStream(fileName)) {
+            fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                throw Exception() << "Can't open file" << fileName << strerror(errno);
+            }
+
+            ownFd = true;
+        }
+
+        buffer.reserve(bufferCapacity);
+    }
+
+    ~StreamOutArchive() {
+        try {
+            flush();
+        } catch (...) {
+        }
+
+        if (ownFd) {
+            close(fd);
+        }
+    }
+
+    template <typename T>
+    void write(const T& value, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        write(&value, 1);
+    }
+
+    template <typename T>
+    void write(const T* ptr, size_t count, typename std::enable_if<std::is_pod<T>::value>::type * = 0) {
+        const char* data = reinterpret_cast<const char*>(ptr);
+        size_t size = sizeof(T) * count;
+
+        if (buffer.size() + size > bufferCapacity) {
+            flush();
+        }
+
+        if (size >= bufferCapacity) {
+            writeAll(data, size);
+        } else {
+            buffer.insert(buffer.end(), data, data + size);
+        }
+    }
+
+    uint64_t pos() const {
+        return flushedPos + buffer.size();
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            writeAll(&buffer.front(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+private:
+    void writeAll(const char* data, size_t size) {
+        while (size) {
+            ssize_t count = ::write(fd, data, size);
+
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                throw Exception() << "Can't write" << fileName << strerror(errno);
+            }
+
+            data += count;
+            size -= count;
+            flushedPos += count;
+        }
+    }
+
+private:
+    int fd;
+    bool ownFd;
+    std::string fileName;
+    const size_t bufferCapacity;
+    std::vector<char> buffer;
+    uint64_t flushedPos;
+};
@@ -1,5 +1,9 @@
 #include "threadpool.h"
 
+#include <exception.h>
+
+#include <chrono>
+
 void Worker::operator()() {
     std::function<void()> task;
     while (true) {
@@ -20,7 +24,7 @@ void Worker::operator()() {
 
         task();
 
-        --threadPool->taskToDoCount;
+        threadPool->taskDone();
     }
 }
 
@@ -42,9 +46,40 @@ ThreadPool::~ThreadPool() {
     wait();
 }
 
+bool ThreadPool::runPendingTask() {
+    std::function<void()> task;
+
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+
+        if (taskQueue.empty()) {
+            return false;
+        }
+
+        task = std::move(taskQueue.front());
+        taskQueue.pop_front();
+    }
+
+    task();
+
+    taskDone();
+
+    return true;
+}
+
+void ThreadPool::waitTasks() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    while (taskToDoCount != 0) {
+        doneCondition.wait(lock);
+    }
+}
+
 void ThreadPool::wait() {
     for (std::thread& thread : workers) {
-        thread.join();
+        if (thread.joinable()) {
+            thread.join();
+        }
     }
 }
 
@@ -61,3 +96,80 @@ void ThreadPool::stop() {
 
     workerCondition.notify_all();
 }
+
+void ThreadPool::push(std::function<void()>&& task) {
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+
+        if (isStop) {
+            throw Exception() << "Can't schedule task on stopped thread pool";
+        }
+
+        taskQueue.push_back(std::move(task));
+        ++taskToDoCount;
+    }
+
+    workerCondition.notify_one();
+}
+
+void ThreadPool::taskDone() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+
+    if (--taskToDoCount == 0) {
+        doneCondition.notify_all();
+    }
+}
+
+TaskGroup::~TaskGroup() {
+    try {
+        wait();
+    } catch (...) {
+    }
+}
+
+void TaskGroup::wait() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (pendingCount == 0) {
+                break;
+            }
+        }
+
+        if (!threadPool.runPendingTask()) {
+            // Rest of group tasks are executed by other threads,
+            // wake up periodically to help with tasks they schedule
+            std::unique_lock<std::mutex> lock(mutex);
+            if (pendingCount != 0) {
+                doneCondition.wait_for(lock, std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    std::exception_ptr ex;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::swap(ex, exception);
+    }
+
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
+}
+
+void TaskGroup::setException(std::exception_ptr ex) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (!exception) {
+        exception = ex;
+    }
+}
+
+void TaskGroup::taskDone() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (--pendingCount == 0) {
+        doneCondition.notify_all();
+    }
+}
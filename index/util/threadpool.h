@@ -5,10 +5,14 @@
 #include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <exception>
+#include <future>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <functional>
+#include <type_traits>
 
 class ThreadPool;
 
@@ -30,17 +34,28 @@ public:
     ~ThreadPool();
 
     template <typename Function>
-    void schedule(Function&& function) {
-        {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            taskQueue.push_back(std::function<void()>(std::move(function)));
-        }
+    std::future<typename std::result_of<typename std::decay<Function>::type()>::type> schedule(Function&& function) {
+        typedef typename std::result_of<typename std::decay<Function>::type()>::type ResultType;
+
+        // std::function requires copyable target, so packaged task is shared
+        std::shared_ptr< std::packaged_task<ResultType()> > task(
+                new std::packaged_task<ResultType()>(std::forward<Function>(function)));
+        std::future<ResultType> result = task->get_future();
 
-        workerCondition.notify_one();
+        push([task]() {
+            (*task)();
+        });
 
-        ++taskToDoCount;
+        return result;
     }
 
+    // Runs one queued task in the calling thread. Returns false if queue is empty
+    bool runPendingTask();
+
+    // Blocks until all scheduled tasks are done. Pool stays alive.
+    // Must not be called from pool threads, use TaskGroup there.
+    void waitTasks();
+
     void wait();
     void waitTasksAndExit();
     void stop();
@@ -49,15 +64,90 @@ public:
         return taskToDoCount;
     }
 
+    size_t size() const {
+        return workers.size();
+    }
+
+private:
+    void push(std::function<void()>&& task);
+    void taskDone();
+
 private:
     typedef std::deque< std::function<void()> > TaskQueue;
     typedef std::list<std::thread> Workers;
 
     std::mutex queueMutex;
     std::condition_variable workerCondition;
+    std::condition_variable doneCondition;
 
     TaskQueue taskQueue;
     Workers workers;
     bool isStop;
     std::atomic_int taskToDoCount;
 };
+
+// Set of tasks which can be waited without pool destruction.
+// Waiting thread executes queued tasks, so groups can be nested.
+class TaskGroup : Noncopyable {
+    template <typename Function>
+    struct GroupTask {
+        GroupTask(TaskGroup* grp, Function&& func) :
+                group(grp),
+                function(std::move(func)) {}
+
+        GroupTask(TaskGroup* grp, const Function& func) :
+                group(grp),
+                function(func) {}
+
+        void operator()() {
+            try {
+                function();
+            } catch (...) {
+                group->setException(std::current_exception());
+            }
+
+            group->taskDone();
+        }
+
+        TaskGroup* group;
+        Function function;
+    };
+
+public:
+    explicit TaskGroup(ThreadPool& pool) :
+            threadPool(pool),
+            pendingCount(0) {}
+
+    ~TaskGroup();
+
+    template <typename Function>
+    void run(Function&& function) {
+        typedef typename std::decay<Function>::type FunctionType;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ++pendingCount;
+        }
+
+        try {
+            threadPool.schedule(GroupTask<FunctionType>(this, std::forward<Function>(function)));
+        } catch (...) {
+            taskDone();
+            throw;
+        }
+    }
+
+    // Waits all group tasks and rethrows first exception thrown by them
+    void wait();
+
+private:
+    void setException(std::exception_ptr ex);
+    void taskDone();
+
+private:
+    ThreadPool& threadPool;
+    std::mutex mutex;
+    std::condition_variable doneCondition;
+    size_t pendingCount;
+    std::exception_ptr exception;
+};